@@ -1,40 +1,606 @@
 // See https://github.com/reinderien/capmeter
-// This is the original version - half-second update, fairly cautious about power usage.
+// Each socket refreshes as soon as its part has discharged, and with LOW_POWER,
+// the meter sleeps as deeply as the next refresh and the serial port allow.
 
 #ifndef __AVR_ATmega2560__
 #error Arduino Mega 2560 required. For others, contact the author or take care during porting.
 #endif
 
+#include <math.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+// Build options; each can be overridden from the compiler command line. The
+// first five are only defaults, and can be changed over serial; see settings.
+#ifndef VERBOSE
 #define VERBOSE 1
+#endif
+#ifndef OUTPUT_BINARY
+#define OUTPUT_BINARY 0 // fixed-size frames instead of "C=...F" text
+#endif
+#ifndef BURST_MS
+#define BURST_MS 0      // average captures over windows this long; 0 for none
+#endif
+#ifndef STATS_N
+#define STATS_N 0       // report the median of windows this many captures long; 0 for none
+#endif
+#ifndef LOW_POWER
+#define LOW_POWER 0     // sleep in standby or power-down between captures when it can
+#endif
+#ifndef CHANNELS
+#define CHANNELS 1      // DUT sockets wired up, from the start of the channel table
+#endif
+#ifndef ICP5_SOCKET
+#define ICP5_SOCKET 0   // one more socket, on an external comparator into ICP5, measured alongside on timer 5
+#endif
+#ifndef DISCHARGE_ADC
+#define DISCHARGE_ADC 0 // watch discharge with the ADC instead of only timing it
+#endif
+#ifndef SLOPE_ADC
+#define SLOPE_ADC 0     // sample the trip level with the ADC instead of assuming it
+#endif
+#ifndef WAVEFORM
+#define WAVEFORM 0      // 'G' records a charge curve with the ADC and fits C and ESR to it
+#endif
+#ifndef RANGE_CONFIRM
+#define RANGE_CONFIRM 2 // captures in a row a marginal range change needs; 1 to take the first
+#endif
+#ifndef PROFILE
+#define PROFILE 0       // time each phase on timer 4; 'P' over serial reports
+#endif
+
+/*
+The range table is generated at compile time from these. Drive resistors go
+in ascending order, on adjacent pins of a channel's port (pin_mask bits 0, 1,
+2...). Charge time is limited to fast_cycles on every resistor, which keeps
+refresh quick for the higher-R ranges; the lowest R also gets a range going up
+to slow_cycles, which sets the maximum capacitance. See the readme and
+range-analysis.r.
+The input capture noise canceller, on the higher-R ranges, only takes the
+comparator's output once it's held for icnc_cycles, so chatter as the slow
+slope crosses the threshold doesn't trip the capture early; the delay it adds
+is taken back off in cal_cap().
+Autoranging keeps a band of 1/range_band of each range's span between moving
+finer and moving back coarser; see rerange().
+*/
+static constexpr float drive_R[] = {270, 15e3, 1e6};
+static constexpr bool drive_icnc[] = {false, true, true}; // ICNC1 on each resistor's ranges
+static constexpr uint8_t icnc_cycles = 4; // ch17.6.2
+static constexpr uint8_t range_band = 16;
+static constexpr uint16_t prescalers[] = {1, 8, 64, 256, 1024}; // CS1 = index+1
+static constexpr uint32_t fast_cycles = 1UL << 19, // 32.8ms
+                          slow_cycles = 1UL << 26; // 4.2s, ~10mF on 270R
+static const uint8_t n_drive = sizeof(drive_R)/sizeof(*drive_R),
+                     n_prescalers = sizeof(prescalers)/sizeof(*prescalers),
+                     n_ranges = n_drive + 1;
+
+// Conductance of all drive resistors in parallel, from the ith
+static constexpr float drive_G(uint8_t i = 0) {
+    return i == n_drive ? 0 : 1/drive_R[i] + drive_G(i+1);
+}
 
-struct {
+static constexpr float v_discharged = 0.01, // residual counted as discharged
+                       taus = 1.514128,  // ln(5/1.1), charge to the comparator
+                       taud = 5.966147,  // ln(3.9/v_discharged), discharge to 10mV
+                       Rd = 1/drive_G(); // all discharging, 270 || 15k || 1M
+
+/*
+Fixed-point helpers, evaluated at compile time. A factor x is stored as
+x*2^shift, with the shift chosen to keep the scaled value just under a limit
+so that it keeps as much precision as the multiply it feeds allows.
+*/
+static constexpr uint8_t fixed_shift(float x, float limit, uint8_t shift = 0) {
+    return (x*2 >= limit || shift == 31) ? shift : fixed_shift(x*2, limit, shift+1);
+}
+static constexpr uint32_t fixed_scale(float x, float limit) {
+    return x*(float)(1UL << fixed_shift(x, limit)) + 0.5f;
+}
+
+// Femtofarads per timer count: C = t/taus/R, t = timer*prescale/F_CPU
+static constexpr float ff_per_count(float R, uint16_t prescale) {
+    return prescale*1e15f/F_CPU/taus/R;
+}
+// Timer 3 ticks (F_CPU/256) of discharge needed per timer 1 count
+static constexpr float ticks_per_count(float R, uint16_t prescale) {
+    return prescale/256.f * Rd/R * taud/taus;
+}
+
+struct range {
     float R;           // Resistor driven for this range
+    uint32_t mR;       // R in milliohms, for put_si() without float
     uint8_t pin_mask;  // PORTF mask for driving resistor
     
     uint16_t prescale; // Timer 1 prescale factor
     uint8_t CS;        // CS1 bits to select this prescaler
+    bool icnc;         // input capture noise canceller on
+    uint16_t delay;    // Q8 timer counts the capture lags the trip by
+    
+    // Overflows are counted in software, extending captures to 32 bits. This
+    // bounds the charge time; past it, the capture is reported as an overflow.
+    uint8_t max_ovf;   // Timer 1 overflows allowed per capture
     
-    // min = floor(2^16 * pres[n+1]/pres[n] * R[n]/R[n+1])
-    uint16_t min;      // ICR threshold below which range should grow
-} static const ranges[] = {
-    //  R pin  pres    CS    min
-    {  270, 1, 1024, B101, 16384},
-    {  270, 1,  256, B100, 16384},
-    {  270, 1,   64, B011,  8192},
-    {  270, 1,    8, B010,  8192},
-    {  270, 1,    1, B001,  9437},
-    { 15e3, 2,    8, B010,  8192},
-    { 15e3, 2,    1, B001,  7864},
-    {  1e6, 4,    8, B010,  8192},
-    {  1e6, 4,    1, B001,     0}
+    // top[n] = (max_ovf[n]+1) * 2^16
+    // min = floor(top[n+1] * pres[n+1]/pres[n] * R[n]/R[n+1])
+    uint32_t min;      // Capture threshold below which range should grow
+    
+    // up = round(2^8 * pres[n]/pres[n+1] * R[n+1]/R[n])
+    uint32_t up;       // Q8 factor predicting the next range's capture from this one's
+    
+    // Hysteresis: a capture has to be under grow to move finer, which puts it
+    // under top*(1 - 2/range_band) there, and over shrink, within top/range_band
+    // of overflowing, to move coarser, which leaves it over grow there
+    uint32_t grow;     // min less 2/range_band of it
+    uint32_t shrink;   // top less 1/range_band of it
+    
+    // C in fF = timer*scale >> shift; 31-bit scale for a 32x32 multiply
+    uint32_t scale;
+    uint8_t shift;
+    
+    // Discharge ticks = timer*dscale >> dshift; scale limited to 2^32/top
+    // so that the product fits in 32 bits
+    uint16_t dscale;
+    uint8_t dshift;
+    
+    constexpr range(float R, uint8_t pin_mask, uint16_t prescale, uint8_t CS,
+                    bool icnc, uint8_t max_ovf, uint32_t min, uint32_t up):
+        R(R), mR(R*1000 + 0.5f), pin_mask(pin_mask), prescale(prescale), CS(CS),
+        icnc(icnc), delay(icnc ? icnc_cycles*256/prescale : 0),
+        max_ovf(max_ovf), min(min), up(up),
+        grow(min - min/range_band*2),
+        shrink((((uint32_t)max_ovf + 1) << 16)/range_band*(range_band - 1)),
+        scale(fixed_scale(ff_per_count(R, prescale), 2147483648.f)),
+        shift(fixed_shift(ff_per_count(R, prescale), 2147483648.f)),
+        dscale(fixed_scale(ticks_per_count(R, prescale), 65536.f/(max_ovf+1))),
+        dshift(fixed_shift(ticks_per_count(R, prescale), 65536.f/(max_ovf+1))) { }
+};
+
+/*
+Range generation. With 32-bit captures, each range only needs the finest
+prescaler that keeps its longest charge within 8 bits of overflows. Range 0 is
+the lowest R's slow range, and range n > 0 is the fast range of resistor n-1,
+at /1. For the default parts that gives
+    R      pres  ovf  min    up
+    270R   /8    127  65536  2048
+    270R   /1    7    9437   14222
+    15k    /1    7    7864   17067
+    1M     /1    7    0      0
+*/
+static constexpr uint8_t range_drive(uint8_t n) { return n ? n-1 : 0; }
+static constexpr uint32_t range_cycles(uint8_t n) { return n ? fast_cycles : slow_cycles; }
+
+// Finest prescaler index keeping `cycles` within 256 overflows
+static constexpr uint8_t fit_prescaler(uint32_t cycles, uint8_t p = 0) {
+    return (p == n_prescalers-1 || cycles/prescalers[p] <= 1UL << 24)
+           ? p : fit_prescaler(cycles, p+1);
+}
+static constexpr uint8_t range_ps(uint8_t n) { return fit_prescaler(range_cycles(n)); }
+static constexpr uint16_t range_prescale(uint8_t n) { return prescalers[range_ps(n)]; }
+static constexpr uint32_t range_top(uint8_t n) { // one past the largest capture
+    return range_cycles(n) / range_prescale(n);
+}
+static constexpr float range_gain(uint8_t n) { // timer counts per RC
+    return drive_R[range_drive(n)] / range_prescale(n);
+}
+static constexpr uint32_t range_min(uint8_t n) {
+    return n+1 < n_ranges ? range_top(n+1) * range_gain(n) / range_gain(n+1) : 0;
+}
+static constexpr uint32_t range_up(uint8_t n) {
+    return n+1 < n_ranges ? 256 * range_gain(n+1) / range_gain(n) + 0.5f : 0;
+}
+static constexpr range make_range(uint8_t n) {
+    return range(drive_R[range_drive(n)], 1 << range_drive(n),
+                 range_prescale(n), range_ps(n) + 1, drive_icnc[range_drive(n)],
+                 range_top(n)/0x10000 - 1, range_min(n), range_up(n));
+}
+
+// range_table<n_ranges>::table is {make_range(0), ..., make_range(n_ranges-1)}
+template<uint8_t... N> struct range_table_of {
+    static constexpr range table[] = {make_range(N)...};
+};
+template<uint8_t... N> constexpr range range_table_of<N...>::table[];
+template<uint8_t C, uint8_t... N> struct range_table : range_table<C-1, C-1, N...> { };
+template<uint8_t... N> struct range_table<0, N...> : range_table_of<N...> { };
+
+static constexpr const range (&ranges)[n_ranges] = range_table<n_ranges>::table;
+static const uint32_t timer_overflow = 0xFFFFFFFF;
+
+// Coverage checks, all ranges from n
+static constexpr bool ranges_finer(uint8_t n = 0) { // each range has a finer time base
+    return n+1 >= n_ranges || (range_gain(n+1) > range_gain(n) && ranges_finer(n+1));
+}
+static constexpr bool ranges_overlap(uint8_t n = 0) { // handoff inside each range
+    return n+1 >= n_ranges ||
+           (range_min(n) < range_top(n) && range_min(n) >= 1024 && ranges_overlap(n+1));
+}
+static constexpr bool ranges_hysteresis(uint8_t n = 0) { // each band leaves room to stay put
+    return n+1 >= n_ranges ||
+           ((uint64_t)ranges[n+1].shrink*ranges[n].min/range_top(n+1) > ranges[n].grow &&
+            ranges[n].grow >= 1024 && ranges_hysteresis(n+1));
+}
+static constexpr bool ranges_fit(uint8_t n = 0) { // capture counts fit the hardware
+    return n >= n_ranges ||
+           (range_top(n) <= 1UL << 24 && range_top(n) % 0x10000 == 0 && ranges_fit(n+1));
+}
+static_assert(ranges_finer(), "drive_R must ascend, and prescalers must allow each range to be finer than the last");
+static_assert(ranges_overlap(), "gap between ranges: the next range takes over too late or with under 10 bits of resolution");
+static_assert(ranges_hysteresis(), "range_band too wide: moving finer would leave a capture that moves back coarser");
+static_assert(RANGE_CONFIRM >= 1, "RANGE_CONFIRM must be at least 1");
+static_assert(ranges_fit(), "range charge times need more than 256 overflows or aren't a whole number of them");
+static_assert(sizeof(drive_icnc) == n_drive, "drive_icnc needs a flag for each of drive_R");
+
+/*
+Each DUT socket (channel) has its three drive resistors on three adjacent port
+pins, in the same order as the range pin_mask bits, and its node on one of the
+comparator's - inputs. Channel 0 is the original socket on AIN1. The others
+drive from PORTL, leaving PL0-1 free as they're the timer 4/5 capture pins, and
+sense on ADC8-15 (PORTK), which the comparator can select through the ADC mux
+when ACME is set and the ADC is off (ch25.1, table 25-1).
+For DISCHARGE_ADC, the ADC reads the node while it discharges. AIN1 isn't an
+ADC pin, so channel 0 leaves its 15k pin floating and reads the node through
+it on ADC1; the other channels read their sense pin directly.
+*/
+struct channel {
+    volatile uint8_t *ddr, *port; // drive pin registers
+    uint8_t shift;                // drive pins are pin_mask << shift
+    uint8_t mux;                  // ADC8-15 for comptor-, or 0xFF for AIN1
+    uint8_t adc;                  // ADC channel reading the node
+    uint8_t adc_float;            // pin_mask bits left floating to read through
+};
+static const channel channels[] = {
+    //  ddr    port sh   mux adc float
+    { &DDRF, &PORTF, 0, 0xFF,  1, B010}, // AIN1 "pin 5", driven from A0-A2
+    { &DDRL, &PORTL, 2,    8,  8,    0}, // ADC8 "A8", driven from pins 47-45
+    { &DDRL, &PORTL, 5,    9,  9,    0}  // ADC9 "A9", driven from pins 44-42
 };
+static_assert(CHANNELS >= 1 && CHANNELS <= sizeof(channels)/sizeof(*channels),
+              "CHANNELS must not exceed the channel table");
 
-static const uint8_t n_ranges = sizeof(ranges)/sizeof(*ranges);
-static uint8_t r_index = 4;
-static uint16_t captured;
-static volatile bool refresh_ready = false, measured = false;
-static bool zeroed = false;
-static float zerocap;
+/*
+ICP5_SOCKET: the comparator and timer 1 take one socket at a time, so a socket
+with a comparator of its own, on timer 5's capture input, can charge while
+they're busy. It's wired as channel 0 is, but driven from A3-A5, with its node
+on the - input of an external comparator whose + input sits at 0.22 of the
+5V supply (39k over 11k, say, for the 1.1V that taus assumes, and ratiometric
+with the supply), and whose output drives ICP5 "pin 48" (PL1), going high as
+the node falls through. Its range, schedule and calibration are its own, and it
+reports as socket CHANNELS. Timer 4 has the other capture pin, but is the epoch.
+*/
+static const uint8_t n_sockets = CHANNELS + ICP5_SOCKET,
+                     icp5_chan = CHANNELS;
+static const channel icp5_channel =
+    { &DDRF, &PORTF, 3, 0xFF,  4, B010}; // external comparator, driven from A3-A5
+static const channel &socket_of(uint8_t c) {
+    return ICP5_SOCKET && c == icp5_chan ? icp5_channel : channels[c];
+}
+
+/*
+Acquisition state, only touched from the ISRs. Timer 3 runs freely at F_CPU/256
+and its overflows are counted to give a 32-bit time base for each channel's
+discharge deadline.
+*/
+struct chan_state {
+    uint8_t r_index, // range in use
+            r_valid, // finest range known not to overflow
+            r_lock;  // range to hold instead of autoranging, or 0xFF
+    uint32_t due,    // timer 3 time once discharged enough to charge again
+             held;   // timer 3 time the refresh period allows the next charge
+    bool hinted;     // moved to the hint's range since the hint was set
+    bool slope;      // charges are long enough on this range for SLOPE_ADC
+    uint8_t r_next,  // range the last captures asked to move to
+            r_votes; // how many of them in a row
+    int8_t r_dir;    // last move, 1 finer or -1 coarser, for counting flaps
+};
+static chan_state chans[n_sockets];
+
+// Autoranging counters per socket, for 'T'
+struct range_stat {
+    uint32_t finer, coarser; // moves
+    uint32_t overflows; // of the coarser ones, those made on an overflow
+    uint32_t flaps;  // moves that undid the one before
+    uint32_t held;   // marginal moves dropped before RANGE_CONFIRM captures agreed
+};
+static range_stat range_stats[n_sockets];
+static uint8_t active = 0;     // channel last charged
+static bool charging = false;  // timer 1 is busy with the active channel
+#if ICP5_SOCKET
+static bool charging5 = false; // timer 5 is busy with the ICP5 socket
+static volatile uint8_t overflows5;
+static uint32_t charge5_us, alarm5_at; // its charge's start, and the compare B alarm
+#endif
+static uint16_t refresh_high;  // timer 3 overflow count
+static uint8_t watching = 0xFF; // channel whose discharge the ADC is reading
+
+/*
+SLOPE_ADC: the charge is an exponential fall from the supply, so rather than
+assume the comparator trips at 1.1V of 5V, ln(5/1.1) time constants in, the
+ADC is auto-triggered by the capture to sample the node, ratiometric to AVCC,
+and the time constant is found from that. The supply and the bandgap then
+drop out. Charges are held until the sample is converted. It only applies
+where the ADC can reach the node without taking the comparator's mux, so
+channel 0 off its 15k range, and is only used once a range's charges are
+long against the ADC's sampling delay and jitter.
+*/
+static bool sampling = false;   // the ADC is armed for the capture in progress
+#if SLOPE_ADC
+static uint32_t sampled_timer;  // capture waiting for its sample
+#endif
+static uint16_t slope_code = 0; // last sample for end_capture()
+static const uint32_t slope_cycles = 1UL << 18, // 16ms, shortest charge to sample
+                      slope_delay = 2*64 + 3;   // cycles from trip to sample-and-hold
+
+/*
+WAVEFORM: after 'G', once a capture on channel 0 comes in on the same range as
+the one before it, and one the ADC can read through adc_float, the next charge
+has the ADC free-running on the node, as for SLOPE_ADC. Every wave_skip'th
+conversion is kept until the buffer is full or the capture ends. The capture
+before sets the rate so that the trip lands about 90% of the way through the
+buffer, converting at /64 or /128. Conversion j is held 13.5 + 13j ADC clocks
+after they start (ch26.4: 25 clocks for the first, 13 after, and the hold 1.5
+clocks into each), and they start wave_start cycles after timer 1.
+*/
+#if WAVEFORM
+enum wave_step { WAVE_IDLE, WAVE_ARMED, WAVE_READY, WAVE_RUNNING, WAVE_DONE };
+static const uint8_t wave_n = 200;
+static volatile uint8_t wave_step = WAVE_IDLE;
+static uint16_t wave_buf[wave_n];
+static uint8_t wave_len;      // samples kept so far
+static uint8_t wave_adps;     // ADC prescaler bits
+static uint16_t wave_skip,    // conversions per sample kept
+                wave_div;     // conversions until the next one's kept
+static uint32_t wave_start;   // cycles from timer 1 start to the first conversion
+static uint32_t wave_timer;   // the capture that ended it
+static uint16_t wave_seq;
+static uint8_t wave_r;
+static const uint16_t wave_fit_lo = 256, // codes to fit between: clear of the
+                      wave_fit_hi = 1000; // trip, and of clipping at the top
+#endif
+
+/*
+Settings that can be changed at run time by the commands in poll_commands().
+They're only written from loop(); of these, the ISRs only read refresh_ticks,
+which is written with interrupts off, and the 8-bit hint_r. r_lock is applied
+through each socket's chan_state.
+*/
+struct settings {
+    bool verbose;
+    bool binary;           // fixed-size frames instead of text
+    uint16_t burst_ms;     // average captures over windows this long
+    uint16_t burst_n;      // or over this many captures; both 0 for no bursts
+    uint16_t refresh_ms;   // shortest time from one capture to the next on a socket
+    uint32_t refresh_ticks; // the same, in timer 3 ticks
+    uint8_t r_lock;        // range every socket holds, or 0xFF to autorange
+    uint8_t hint_r;        // range for the expected part, or 0xFF for no hint
+    uint64_t hint;         // fF, expected part on every socket
+    uint8_t stat_n;        // statistics window in captures, or 0 for none
+    uint16_t stat_ppm;     // spread a window must settle to, or 0 to report every one
+    uint32_t baud;         // USART0, set by a U handshake; see set_baud()
+    bool low_power;        // sleep deeper than idle between captures
+};
+static settings config = {VERBOSE, OUTPUT_BINARY, BURST_MS, 0, 0, 0, 0xFF, 0xFF, 0,
+                          STATS_N, 1000, 115200, LOW_POWER};
+
+/*
+Captures are queued by the timer 1 ISRs and drained by loop(), so that
+acquisition never waits on the UART. Single producer (ISR), single consumer
+(loop): each index is only ever written by one side, and 8-bit accesses are
+atomic, so no locking is needed - only a compiler barrier to keep the record
+write ordered before the index update.
+*/
+struct capture {
+    uint32_t timer;  // ICR1 extended by overflow count, or timer_overflow
+    uint32_t stamp;  // epoch in us when the comparator tripped, or gave up
+    uint8_t channel; // socket measured
+    uint8_t r_index; // range in effect for this capture
+    uint16_t seq;    // increments per capture; gaps mean dropped records
+    uint16_t adc;    // node at the trip for SLOPE_ADC, /1024 of AVCC; 0 if not sampled
+};
+static capture ring[16];
+static const uint8_t ring_mask = sizeof(ring)/sizeof(*ring) - 1;
+static volatile uint8_t ring_head = 0, // written by ISR only
+                        ring_tail = 0; // written by loop only
+static uint16_t seq = 0;
+static volatile uint8_t overflows; // upper bits of the capture in progress
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+/*
+Burst mode: captures come back to back as fast as discharge allows, so for
+small caps there are many per report window. They're accumulated here and
+reported as a mean and variance. Sums are taken of offsets from the first
+capture, which keeps them small and exact, and keeps the variance from
+cancelling itself out in float.
+*/
+struct burst {
+    uint8_t channel;
+    uint8_t r_index; // all captures in a burst share a range
+    uint16_t seq;    // of the latest capture
+    uint32_t stamp;  // of the latest capture
+    uint16_t n,      // captures expected to fit in the window
+             count;  // captures accumulated so far
+    uint32_t base;   // first capture
+    int64_t sum;     // of (timer - base)
+    uint64_t sumsq;  // of (timer - base)^2
+};
+static burst acc[n_sockets];
+
+/*
+Statistics mode: instead of every capture, each socket reports a window of its
+last stat_n captures on one range, kept both in arrival order and sorted. A
+report is the median and the mean and variance of the middle half, so a
+capture or two far out - the glitches around a rerange, or a part being
+plugged in - have no effect, and it only goes out once the window is full and
+has settled to within stat_ppm. Reports are at most one per window's worth of
+captures. See stat_add().
+*/
+static const uint8_t stat_max = 16;
+static_assert(STATS_N == 0 || (STATS_N >= 3 && STATS_N <= 16),
+              "STATS_N must be 0 or 3 to 16");
+struct stat_window {
+    uint8_t channel;
+    uint8_t r_index;  // all captures in a window share a range
+    uint8_t count;    // captures in the window, up to stat_n
+    uint8_t next;     // index into timers of the next to write, and the oldest
+    uint8_t since;    // captures since the last report, up to stat_n
+    uint16_t seq;     // of the latest capture
+    uint32_t stamp;   // of the latest capture
+    uint32_t timers[stat_max]; // in arrival order, a ring
+    uint32_t sorted[stat_max]; // the same, ascending
+};
+static stat_window stats[n_sockets];
+
+/*
+Zero tracking: each socket's empty reading, its parasitic capacitance, is
+followed over time and taken off every reading. See zero_cap().
+*/
+struct zero_track {
+    uint32_t base; // empty-socket reading, fF in Q4
+    bool valid;    // a baseline has been taken
+    bool force;    // take the next finest-range reading as the baseline
+};
+static zero_track zeros[n_sockets];
+static const uint32_t zero_max = 100000, // fF; largest reading taken as empty at boot
+                      zero_step = 1000;  // fF; a change bigger than this is a part
+
+/*
+Calibration: each socket's ranges get an offset, the timer reading with the
+socket empty, and a gain correcting for the drive resistor's tolerance. They're
+measured on command (see cal_add()) and kept in EEPROM, in a cal_image at
+cal_addr that's only used if its magic, sizes and CRC-16 all check out.
+*/
+struct cal_entry {
+    int32_t offset; // timer counts, Q8
+    uint16_t gain;  // Q15, so 32768 is 1
+};
+static cal_entry cal[n_sockets][n_ranges];
+struct cal_image {
+    uint16_t magic;
+    uint8_t channels, ranges;
+    cal_entry entry[n_sockets][n_ranges];
+    uint16_t crc; // of everything before it
+};
+static const uint16_t cal_magic = 0xCA1C;
+static uint8_t *const cal_addr = 0;   // EEPROM address of the cal_image
+static bool cal_loaded = false;
+
+enum cal_mode : uint8_t { CAL_IDLE, CAL_OFFSET, CAL_GAIN };
+struct cal_acc { // one socket's calibration in progress
+    uint8_t r_index; // range being measured
+    uint8_t n;       // captures summed; the first is skipped
+    bool done;
+    uint32_t sum;    // of timer readings
+};
+static cal_mode cal_state = CAL_IDLE;
+static cal_acc cal_accs[n_sockets];
+static uint64_t cal_ref;         // fF, reference part for CAL_GAIN
+static const uint8_t cal_n = 16; // captures averaged per range
+
+/*
+Epoch: timer 4 runs freely with its overflows counted, as the time base for
+record timestamps. It runs at F_CPU/8, counting half-microseconds, except in
+profiling builds, where it runs at F_CPU so that it counts cycles as well.
+*/
+#if PROFILE
+static const uint8_t epoch_cs = B001,    // no prescaler
+                     epoch_us_shift = 4; // log2 of counts per us
+#else
+static const uint8_t epoch_cs = B010,    // /8
+                     epoch_us_shift = 1;
+#endif
+static_assert(F_CPU == 16000000UL, "epoch_us_shift assumes a 16MHz clock");
+static uint32_t epoch_high;          // timer 4 overflow count
+static uint32_t charge_us;           // epoch at the start of the charge in progress
+
+/*
+Sleep modes, ch11. Timers 1, 3 and 4 and the UART only run in idle, so that's
+all the sleep there is while a charge, an ADC conversion or output is in
+progress. With low_power on, a wait for the next charge long enough for a
+watchdog period or more is slept in standby, or power-down for 32ms and up,
+where the 16K CK start-up (with the Arduino fuses) is under 1/16 of it. The
+watchdog's interrupt wakes the meter at least an eighth of the wait early, the
+stopped timers 3 and 4 are moved on by the time asleep, and the rest of the
+wait is idle, so the charge starts on time. The watchdog's 128kHz oscillator is
+only good to 10% or so, so its period is measured against timer 3 at boot.
+A byte arriving over serial also wakes the meter, as a pin change on RXD0,
+but is itself lost; the rest of the watchdog period is then timed by timer 3.
+*/
+enum sleep_kind : uint8_t { SLEEP_IDLE, SLEEP_STANDBY, SLEEP_POWER_DOWN, n_sleeps };
+static const uint8_t sleep_sm[n_sleeps] = {B000, B110, B010}; // SMCR.SM, table 11-2
+static const uint8_t sleep_start_ticks[n_sleeps] = {0, 0, 64}; // start-up, timer 3 ticks
+static const uint8_t wdt_cal_wdp = 2;     // 64ms period measured at boot
+static const uint32_t sleep_rx_us = 1000000; // stay idle this long after a byte arrives
+static volatile uint16_t wdt_cal_ticks;   // timer 3 ticks per 64ms watchdog period; 0 until measured
+static uint32_t wdt_cal_start;
+static volatile uint8_t deep = SLEEP_IDLE; // deep sleep whose watchdog period is running
+static uint32_t deep_ticks;               // its period and start-up, in timer 3 ticks
+static bool deep_early;                   // woken before the watchdog, at deep_woke
+static uint32_t deep_woke;
+static uint32_t alarm_at;                 // timer 3 time start_next() set the alarm for
+static uint8_t sleep_deepest;             // deepest sleep since the last charge
+static uint32_t rx_last_us;               // epoch of the latest received byte
+struct sleep_stat {
+    uint32_t sleeps, ticks; // deep sleeps, and timer 3 ticks spent in them
+    uint32_t charges;       // charges started by the alarm after this kind of sleep
+    uint16_t late_max;      // and how long after they were due, in timer 3 ticks
+    uint32_t late_sum;
+};
+static sleep_stat sleep_stats[n_sleeps];
+
+/*
+Profiling: PROFILE_BEGIN/END bracket each phase with timestamps from the
+epoch, in cycles. The cost of taking the timestamps themselves is measured at
+startup and taken off.
+*/
+enum prof_phase : uint8_t {
+    PROF_CHARGE,    // charge(), starting a capture
+    PROF_CAPTURE,   // timer 1 capture ISR, including everything below
+    PROF_DISCHARGE, // discharge()
+    PROF_RERANGE,   // rerange()
+    PROF_OUTPUT,    // formatting and queueing a capture or burst
+    PROF_SLEEP,     // until loop() runs again, including the ISR that woke it
+    n_phases
+};
+struct prof_stat {
+    uint32_t n, min, max; // cycles
+    uint64_t sum;
+};
+#if PROFILE
+static prof_stat prof[n_phases];
+static uint8_t prof_overhead;
+#define PROFILE_BEGIN(phase) const uint32_t prof_##phase = epoch_now()
+#define PROFILE_END(phase) prof_add(phase, prof_##phase)
+#else
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+#endif
+
+/*
+USART0 is driven directly instead of through Serial, so that output never
+blocks acquisition or the loop. Each record is built in a line (or a binary
+frame) and queued whole for the UDRE ISR to send; if the queue hasn't room, the
+record is dropped and the next one supersedes it, and the seq gap shows the
+drop. The queues are single producer, single consumer like the capture ring,
+with the TX indices wrapping on their own at 256. The Arduino core's USART0
+ISRs are only linked in along with Serial, so Serial must not be used.
+*/
+static uint8_t tx_buf[256];
+static volatile uint8_t tx_head = 0, // written by loop only
+                        tx_tail = 0; // written by ISR only
+// TXC0 is only set once a transmission finishes, so until the ring has first
+// drained into the UART, nothing is going out whatever TXC0 says
+static volatile bool tx_used = false;
+static uint32_t tx_drops = 0;        // records dropped for lack of room
+static uint8_t rx_buf[16];
+static const uint8_t rx_mask = sizeof(rx_buf) - 1;
+static volatile uint8_t rx_head = 0, // written by ISR only
+                        rx_tail = 0; // written by loop only
+
+struct line { // a text record being built
+    char buf[128];
+    uint8_t len;
+    line(): len(0) { }
+};
 
 
 static void setup_power() {
@@ -76,44 +642,324 @@ static void setup_ports() {
     DDRF = B00000111;  // PF0-2 set to discharge initially; others unused
     PORTF = 0xFF;      // All pullups or sourcing
     DIDR0 = B00000111; // Turn off digital input buffer for ADC0-2 (PF0-2)
+    
+    for (uint8_t c = 1; c < CHANNELS; c++) {
+        const channel &ch = channels[c];
+        const uint8_t sense = 1 << (ch.mux - 8);
+        *ch.ddr  |= B111 << ch.shift; // Drive pins set to discharge initially
+        *ch.port |= B111 << ch.shift;
+        DDRK  &= ~sense; // Sense pin input, no pullup
+        PORTK &= ~sense;
+        DIDR2 |= sense;  // Turn off digital input buffer for the sense pin
+    }
+    
+    #if ICP5_SOCKET
+    // Drive pins as channel 0's; ICP5 (PL1) stays an input, with the pullup
+    // in case the comparator's output is open-drain
+    DDRF  |= B111 << icp5_channel.shift;
+    DIDR0 |= B111 << icp5_channel.shift;
+    #endif
 }
 
 static void setup_refresh() {
     /*
-    Todo - This needs to change for big caps, but for now leave it
-    
     Use timer 3 for output refresh (timers 0, 2 are 8-bit,
     timer 1 is used for charge capture). This is 16-bit.
-    Use Clear Timer on Compare Match (Auto Reload) - see  ch17.9.2
+    Free-running in normal mode - see ch17.9.1 - with overflows counted in
+    software, and compare A as an alarm for the next channel due to charge.
     Use a /256 prescaler.
+    The deadlines set here only apply to the first measurement; after that
+    schedule_refresh() sets them based on how long each cap needs to
+    discharge.
     */
+    for (uint8_t c = 0; c < n_sockets; c++) {
+        chans[c].r_index = 1;
+        chans[c].r_lock = 0xFF;
+        chans[c].due = 31250; // 500ms * 16e6 / 256, to settle after power-up
+    }
+    
     PRR1 &= ~(1 << PRTIM3); // Power on timer 3
-    TIMSK3 = (1 << OCIE3A); // Only enable compare A interrupt
+    TIMSK3 = (1 << OCIE3A) | // enable compare A interrupt
+             (ICP5_SOCKET << OCIE3B) | // and B, the ICP5 socket's alarm
+             (1 << TOIE3);   // enable overflow interrupt
     TCCR3A = (B00 << COM3A0) | // OC pins unused
              (B00 << COM3B0) |
              (B00 << COM3C0) |
-             (B00 << WGM30);   // CTC
+             (B00 << WGM30);   // Normal
     TCCR3B = (0 << ICNC3)    | // Disable noise canceller
              (0 << ICES3)    | // Capture edge doesn't apply here
-             (B01  << WGM32) | // CTC, OCR3A top
+             (B00  << WGM32) | // Normal count up, no clear
              (B100 << CS30);   // Start counting, 1/256 prescaler
     
-    // Do NOT do this before initializing TCCR3A
-    OCR3A = 31250; // 500ms * 16e6 / 256
+    OCR3A = 31250;
+    #if ICP5_SOCKET
+    OCR3B = 31250;
+    alarm5_at = 31250;
+    #endif
+}
+
+static bool uart_send(const void *data, uint8_t len, bool wait) {
+    /*
+    Queue a whole record from loop() or setup(). Without wait, drop it if it
+    doesn't fit; with wait, sleep until the ISR has made room, for the few
+    messages that mustn't be lost.
+    */
+    while ((uint8_t)(tx_tail - tx_head - 1) < len) {
+        if (!wait) {
+            tx_drops++;
+            return false;
+        }
+        cli();
+        if ((uint8_t)(tx_tail - tx_head - 1) < len) {
+            sei();       // as in loop(), so the ISR can't
+            sleep_cpu(); // slip in before we sleep
+        }
+        sei();
+    }
+    const uint8_t *d = (const uint8_t*)data;
+    uint8_t head = tx_head;
+    for (uint8_t i = 0; i < len; i++)
+        tx_buf[head++] = d[i];
+    barrier();
+    tx_head = head;
+    // The ISR may clear this at any point; it's only ever set from here, so
+    // the read-modify-write can't lose anything
+    UCSR0B |= 1 << UDRIE0;
+    return true;
+}
+
+static int16_t uart_read() {
+    const uint8_t tail = rx_tail;
+    if (tail == rx_head)
+        return -1;
+    const uint8_t b = rx_buf[tail];
+    barrier();
+    rx_tail = (tail + 1) & rx_mask;
+    return b;
+}
+
+static void put(line &l, char c) {
+    if (l.len < sizeof(l.buf))
+        l.buf[l.len++] = c;
+}
+static void put(line &l, const char *s) {
+    while (*s)
+        put(l, *s++);
+}
+static void put_uint(line &l, uint32_t x) {
+    char digits[11];
+    put(l, ultoa(x, digits, 10));
+}
+static void put_float(line &l, float x, uint8_t decimals) {
+    char digits[24];
+    put(l, dtostrf(x, 1, decimals, digits));
+}
+static bool send_line(const line &l, bool wait) {
+    return uart_send(l.buf, l.len, wait);
+}
+
+/*
+Binary output, all little-endian; see the readme for the layout. Each frame
+starts with a sync byte and ends with a CRC-8 (CCITT, poly 0x07) of every byte
+in between, so the host can resynchronize after noise or a dropped byte.
+*/
+static const uint8_t sync_header = 0x5A,
+                     sync_sample = 0xA5,
+                     sync_burst = 0xA6,
+                     sync_stats = 0xA7,
+                     sync_wave = 0xA8,
+                     sync_wave_codes = 0xA9,
+                     proto_version = 8;
+
+static void send_frame(uint8_t *frame, uint8_t len, bool wait = false) {
+    uint8_t crc = 0;
+    for (uint8_t i = 1; i < len-1; i++)
+        crc = _crc8_ccitt_update(crc, frame[i]);
+    frame[len-1] = crc;
+    uart_send(frame, len, wait);
+}
+
+static void send_header() {
+    // The host needs the range constants and calibration to turn a raw timer
+    // into farads; this is sent again whenever the calibration changes
+    uint8_t frame[9 + 8*n_ranges + 6*n_sockets*n_ranges], *f = frame;
+    *f++ = sync_header;
+    *f++ = proto_version;
+    const uint32_t fcpu = F_CPU;
+    memcpy(f, &fcpu, 4); f += 4;
+    *f++ = n_sockets;
+    *f++ = n_ranges;
+    for (uint8_t r = 0; r < n_ranges; r++) {
+        const uint32_t R = ranges[r].R;
+        memcpy(f, &R, 4); f += 4;
+        memcpy(f, &ranges[r].prescale, 2); f += 2;
+        memcpy(f, &ranges[r].delay, 2); f += 2;
+    }
+    for (uint8_t c = 0; c < n_sockets; c++)
+        for (uint8_t r = 0; r < n_ranges; r++) {
+            memcpy(f, &cal[c][r].offset, 4); f += 4;
+            memcpy(f, &cal[c][r].gain, 2); f += 2;
+        }
+    send_frame(frame, sizeof(frame), true);
+}
+
+static uint32_t epoch_now(uint8_t shift = 0) {
+    /*
+    Timer 4 extended by its overflow count, as for refresh_now(), but safe to
+    call with interrupts on. In timer counts >> shift, wrapping at 32 bits.
+    */
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t tcnt = TCNT4;
+    uint32_t high = epoch_high;
+    if ((TIFR4 & (1 << TOV4)) && tcnt < 0x8000)
+        high++;
+    SREG = sreg;
+    return high << (16 - shift) | tcnt >> shift;
+}
+
+static void setup_epoch() {
+    /*
+    Timer 4, free-running in normal mode. Its overflow ISR runs every 32.8ms,
+    or every 4.1ms in profiling builds.
+    */
+    PRR1 &= ~(1 << PRTIM4); // Power on timer 4
+    TIMSK4 = 1 << TOIE4;    // enable overflow interrupt
+    TCCR4A = (B00 << COM4A0) | // OC pins unused
+             (B00 << COM4B0) |
+             (B00 << COM4C0) |
+             (B00 << WGM40);   // Normal
+    TCCR4B = (B00 << WGM42) |  // Normal count up, no clear
+             (epoch_cs << CS40); // Start counting
+}
+
+#if PROFILE
+static void prof_add(uint8_t phase, uint32_t start) {
+    uint32_t t = epoch_now() - start;
+    t = t > prof_overhead ? t - prof_overhead : 0;
+    prof_stat &st = prof[phase];
+    if (!st.n || t < st.min)
+        st.min = t;
+    if (t > st.max)
+        st.max = t;
+    st.sum += t;
+    st.n++;
+}
+
+static void prof_report() {
+    // Takes a snapshot and starts over, so each report covers the time since the last
+    static const char *const names[n_phases] = {
+        "charge", "capture", "discharge", "rerange", "output", "sleep"
+    };
+    prof_stat snap[n_phases];
+    cli();
+    memcpy(snap, prof, sizeof(prof));
+    memset(prof, 0, sizeof(prof));
+    sei();
+    
+    line head;
+    put(head, "\nphase n min max mean (cycles)\r\n");
+    send_line(head, true);
+    for (uint8_t p = 0; p < n_phases; p++) {
+        const prof_stat &st = snap[p];
+        line l;
+        put(l, names[p]); put(l, ' ');
+        put_uint(l, st.n); put(l, ' ');
+        put_uint(l, st.min); put(l, ' ');
+        put_uint(l, st.max); put(l, ' ');
+        put_float(l, st.n ? (float)st.sum / st.n : 0, 1);
+        put(l, "\r\n");
+        send_line(l, true);
+    }
+    line drops;
+    put(drops, "dropped "); put_uint(drops, tx_drops); put(drops, "\r\n");
+    send_line(drops, true);
+}
+
+static void setup_profile() {
+    // After setup_epoch()
+    const uint32_t t0 = epoch_now();
+    prof_overhead = epoch_now() - t0;
+}
+#endif
+
+/*
+Baud rate changes: 'U' with a rate switches to it once the reply has gone out
+at the old one, and the host must then send 'U' alone at the new rate within
+baud_confirm_us, or the meter goes back to the rate it boots at. The 16U2 USB
+bridge on the Mega handles up to 2Mbaud.
+*/
+static const uint32_t baud_boot = 115200,
+                      baud_confirm_us = 1000000;
+static bool baud_pending = false;  // waiting for the host to confirm config.baud
+static uint32_t baud_since;        // epoch in us of the change
+
+static uint16_t baud_ubrr(uint32_t baud) {
+    // Double speed UBRR for a rate, or 0xFFFF if it's off by more than 2.5%
+    // (table 22-12). 115200 is 2.1% fast; 250k, 500k, 1M and 2M are exact.
+    if (!baud || baud > F_CPU/8)
+        return 0xFFFF;
+    const uint32_t ubrr = (F_CPU/8 + baud/2)/baud - 1,
+                   actual = F_CPU/8/(ubrr + 1),
+                   err = actual > baud ? actual - baud : baud - actual;
+    return ubrr > 0xFFF || err > baud/40 ? 0xFFFF : ubrr;
+}
+
+static void uart_drain() {
+    // Sleep until the ISR has sent everything queued, and then for long enough
+    // that the last bytes are out of UDR0 and the shift register
+    for (;;) {
+        cli();
+        if (tx_head == tx_tail)
+            break;
+        sei();
+        sleep_cpu();
+    }
+    sei();
+    const uint32_t start = epoch_now(epoch_us_shift),
+                   bytes_us = 2*10*1000000/config.baud + 1;
+    while (epoch_now(epoch_us_shift) - start < bytes_us)
+        sleep_cpu();
+}
+
+static void set_baud(uint32_t baud) {
+    // Only a rate baud_ubrr() accepts
+    UBRR0 = baud_ubrr(baud);
+    UCSR0A = (1 << U2X0);     // double speed
+    config.baud = baud;
 }
 
 static void setup_serial() {
-    PRR0 &= ~(1 << PRUSART0); // Power up USART0 for output to USB over pins 0+1
-    Serial.begin(115200);     // UART at 115200 baud
-    #if VERBOSE
-    Serial.println("\nInitialized");
-    #endif
+    /*
+    USART0, ch22, to USB over pins 0+1. 8N1 at baud_boot, in double speed mode
+    as the Arduino core sets it up until a U command changes it.
+    */
+    PRR0 &= ~(1 << PRUSART0); // Power up USART0
+    set_baud(baud_boot);
+    UCSR0C = (B00 << UMSEL00) | // asynchronous
+             (B00 << UPM00)   | // no parity
+             (0 << USBS0)     | // 1 stop bit
+             (B11 << UCSZ00);   // 8 data bits
+    UCSR0B = (1 << RXCIE0) | // enable receive interrupt
+             (0 << TXCIE0) | // transmit complete doesn't matter
+             (0 << UDRIE0) | // data register empty enabled once there's data
+             (1 << RXEN0)  | // enable receiver
+             (1 << TXEN0)  | // enable transmitter
+             (0 << UCSZ02);  // 8 data bits
+    if (config.binary)
+        send_header();
+    else if (config.verbose) {
+        line l;
+        put(l, cal_loaded ? "\nInitialized, calibrated\r\n" : "\nInitialized\r\n");
+        send_line(l, false);
+    }
 }
 
 static void setup_comptor() {
     /* Analog comparator: ch25, p265
     + connected to bandgap ref via ACSR.ACBG=1
-    - connected to AIN1 (PE3 "pin 5") via ADCSRB.ACME=0
+    - connected to AIN1 (PE3 "pin 5") via ADCSRB.ACME=0; for the other
+      channels, charge() sets ACME and selects their pin through the ADC mux
     ACO output connected via ACIC=1 to input capture
     Since the ACIS edge selector appears after ACO, and ACO itself is sent to
     capture, and we don't use the AC interrupt itself, ACIS should not matter.
@@ -122,7 +968,7 @@ static void setup_comptor() {
     stability described in ch12.3, p60
     shown as 1.1V in ch31.5, p360
     */
-    ACSR = (0 << ACD)  | // comparator enabled
+    ACSR = (1 << ACD)  | // comparator disabled until the first charge
            (1 << ACBG) | // select 1.1V bandgap ref for +
            (0 << ACO)  | // output - no effect
            (1 << ACI)  | // "clear" interrupt flag
@@ -168,116 +1014,1222 @@ static void setup_capture() {
 }
 
 static void start_capture() {
-    // Todo - this needs some work
-    // ACSR &= ~(1 << ACD); // Enable comparator
-    
     PRR0 &= ~(1 << PRTIM1); // Turn on power for T1
     TCNT1 = 0;              // Clear timer value
+    overflows = 0;
+    TIFR1 = (1 << ICF1) | (1 << TOV1); // "clear" stale capture and overflow
     // CS1 prescaler is based on the selected range
-    TCCR1B = (0 << ICNC1)   | // Disable noise cancellation
+    const range &rg = ranges[chans[active].r_index];
+    TCCR1B = (rg.icnc << ICNC1) | // Noise cancellation for the range
              (1 << ICES1)   | // ICP rising edge
              (B00 << WGM12) | // Normal count up, no clear (p145)
-             (ranges[r_index].CS << CS10); // Start counting, internal clock source
+             (rg.CS << CS10); // Start counting, internal clock source
+}
+
+#if ICP5_SOCKET
+static void setup_capture5() {
+    // Timer 5 as timer 1, ch17, capturing from ICP5 instead of the comparator
+    PRR1 &= ~(1 << PRTIM5); // Turn on power for T5
+    TIMSK5 = (1 << ICIE5) | // enable capture interrupt
+             (1 << TOIE5);  // enable overflow interrupt
+    TCCR5A = (B00 << WGM50); // Normal count up, no clear
+    PRR1 |= 1 << PRTIM5;    // off until the first charge
+}
+
+static void start_capture5() {
+    PRR1 &= ~(1 << PRTIM5); // Turn on power for T5
+    TCNT5 = 0;
+    overflows5 = 0;
+    TIFR5 = (1 << ICF5) | (1 << TOV5); // "clear" stale capture and overflow
+    const range &rg = ranges[chans[icp5_chan].r_index];
+    TCCR5B = (rg.icnc << ICNC5) | // Noise cancellation for the range
+             (1 << ICES5)   | // ICP rising edge
+             (B00 << WGM52) | // Normal count up, no clear
+             (rg.CS << CS50); // Start counting, internal clock source
+}
+
+static void stop_capture5() {
+    TCCR5B = 0;
+    TIFR5 = (1 << ICF5) | (1 << TOV5);
+    PRR1 |= 1 << PRTIM5; // Turn off power for T5
 }
+#endif
 
 static void stop_capture() {
-    // Todo - this needs some work
-    // ACSR |= 1 << ACD; // Disable comparator
+    // Off between charges to save power; ACIE must be off while ACD changes (ch25.3.2)
+    ACSR |= 1 << ACD;
     
     TCCR1B = 0; // Stop clock by setting CS1=000
+    // If capture and overflow happened together, only handle the first
+    TIFR1 = (1 << ICF1) | (1 << TOV1);
     PRR0 |= 1 << PRTIM1; // Turn off power for T1
 }
 
-static void print_si(float x) {
-    static const char pre[] = "\0pnum kMG";
-    const char *p = pre+5;
-    for (; x < 1 && p[-1]; p--)
-        x *= 1e3;
-    for (; x >= 1e3 && p[1]; p++)
-        x /= 1e3;
-
-    uint8_t digs = 3;
-    for (float xsig = x; xsig > 1; xsig /= 10)
-        digs--;
-
-    Serial.print(x, digs);
-    Serial.print(*p);
-}
-
-static void print_cap(uint16_t timer) {
-    const float taus = 1.514128, // ln(5/1.1)
-                f = F_CPU/ranges[r_index].prescale,
-                t = ((float)timer)/f,
-                R = ranges[r_index].R;
-    
-    float C = t/taus/R;
-    if (!zeroed) {
-        if (r_index == n_ranges-1 && C < 100e-12) {
-            zerocap = C;
-            #if VERBOSE
-            {
-                Serial.print("\nZeroing to ");
-                print_si(zerocap);
-                Serial.println('F');
-            }
-            #endif
-            zeroed = true;
+/*
+Decimal output without floats or division: the decades live in flash (ch8.1)
+and each digit is counted out by subtracting its decade, at most 9 times.
+*/
+static const uint64_t decades[] PROGMEM = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+static const uint8_t n_decades = sizeof(decades)/sizeof(*decades);
+
+static uint64_t decade(uint8_t k) {
+    uint64_t d;
+    memcpy_P(&d, &decades[k], sizeof(d));
+    return d;
+}
+
+// Units for put_si(), as the prefix of x's unit
+static const char si_prefix[] = "fpnum kMGTPE";
+static const uint8_t si_femto = 0, si_pico = 1, si_milli = 4;
+
+static void put_si(line &l, uint64_t x, uint8_t unit) {
+    // x to 3 significant digits with an SI prefix; under 1000 units, as a
+    // fraction of the next prefix up, such as 0.500pF for 500fF
+    uint8_t d = 0; // x's highest decade
+    while (d+1 < n_decades && x >= decade(d+1))
+        d++;
+    uint8_t lo = 0; // the lowest decade printed
+    if (d < 3)
+        d = 3;
+    else {
+        lo = d - 2;
+        const uint64_t half = decade(lo)/2;
+        x = x > ~half ? ~(uint64_t)0 : x + half; // saturating at the top of the range
+        if (d+1 < n_decades && x >= decade(d+1)) {
+            // Rounded up to the next decade, as 999.6 to 1.00k
+            d++;
+            lo++;
+        }
+    }
+
+    const uint8_t point = d - d%3;
+    for (int8_t k = d; k >= lo; k--) {
+        const uint64_t dk = decade(k);
+        char c = '0';
+        for (; x >= dk; x -= dk)
+            c++;
+        put(l, c);
+        if (k == point && k > lo)
+            put(l, '.');
+    }
+    put(l, si_prefix[unit + point/3]);
+}
+
+static uint64_t to_uint(float x) {
+    // Rounded, for put_si() of a figure computed as a float
+    return x > 0 ? (uint64_t)(x + 0.5f) : 0;
+}
+
+static uint64_t cal_cap(uint8_t c, uint8_t r, uint64_t timerq8) {
+    // fF from a Q8 timer reading, less the capture delay and the range's
+    // offset, and times its gain
+    const range &rg = ranges[r];
+    const cal_entry &k = cal[c][r];
+    const int64_t t = (int64_t)timerq8 - rg.delay - k.offset;
+    if (t <= 0)
+        return 0;
+    return ((uint64_t)t*rg.scale >> (rg.shift + 8))*k.gain >> 15;
+}
+
+static uint64_t zero_cap(uint8_t c, uint8_t r, uint64_t C) {
+    /*
+    An empty socket always reads on the finest range. The first reading there
+    under zero_max, or the first after a 'Z' command, becomes the baseline.
+    After that, finest-range readings within zero_step of the baseline are
+    taken as the socket still (or again) being empty, and the baseline follows
+    them with a 1/64 EWMA to track drift. Anything else means there's a part
+    in, and the baseline is held until readings come back to it. So a part
+    under zero_step is indistinguishable from drift, and is slowly zeroed out.
+    */
+    zero_track &z = zeros[c];
+    const bool finest = r == n_ranges-1;
+    if (finest && (z.force || (!z.valid && C < zero_max))) {
+        z.base = C << 4;
+        z.valid = true;
+        z.force = false;
+        if (config.verbose && !config.binary) {
+            line l;
+            put(l, "\nZeroing "); put_uint(l, c);
+            put(l, " to "); put_si(l, C, si_femto);
+            put(l, "F\r\n");
+            send_line(l, true);
         }
     }
-    if (zeroed) {
-        C -= zerocap;
-        if (C < 0) C = 0;
+    else if (z.valid && finest) {
+        const uint32_t base = z.base >> 4;
+        if (C < base + zero_step && C + zero_step > base) // empty
+            z.base += ((int32_t)(C << 4) - (int32_t)z.base)/64;
     }
     
-    #if VERBOSE
-    {
-        Serial.print("r_index="); Serial.print(r_index, DEC); Serial.print(' ');
-        Serial.print("f="); print_si(f); Serial.print("Hz ");
-        Serial.print("t="); print_si(t); Serial.print("s ");
-        Serial.print("timer="); Serial.print(timer, DEC); Serial.print(' ');
-        Serial.print("R="); print_si(R); Serial.print("ohm ");
+    if (z.valid) {
+        const uint32_t base = z.base >> 4;
+        C = C > base ? C - base : 0;
     }
-    #endif
+    return C;
+}
 
-    Serial.print('C');
-    if (timer == 0xFFFF) {
-        Serial.print('>');
+// With several channels, give each reading its own line
+static const char *const eol = n_sockets > 1 ? "    \n" : "    \r";
+
+static void print_c(line &l, uint8_t c, uint64_t C, bool over) {
+    #if CHANNELS + ICP5_SOCKET > 1
+    put_uint(l, c); put(l, ':');
+    #else
+    (void)c;
+    #endif
+    put(l, 'C');
+    if (over) {
+        put(l, '>');
         PORTB &= B01111111; // Clear LED if we overflowed
     }
     else {
-        Serial.print('=');
+        put(l, '=');
         PORTB |= B10000000; // Set LED if we've measured a capacitance
     }
-    print_si(C); Serial.print("F    \r");
+    put_si(l, C, si_femto); put(l, 'F');
 }
 
+static void print_cap(const capture &cap) {
+    const range &rg = ranges[cap.r_index];
+    const uint32_t timer = cap.timer;
+    const bool over = timer == timer_overflow;
+    
+    // An overflow is reported as more than the range's largest capture
+    const uint32_t counts = over ? (uint32_t)(rg.max_ovf + 1) << 16 : timer;
+    uint64_t C = zero_cap(cap.channel, cap.r_index,
+                          cal_cap(cap.channel, cap.r_index, (uint64_t)counts << 8)); // fF
+    
+    line l;
+    if (config.verbose) {
+        // Timer rate in mHz and capture time in ps, for put_si(); an overflow
+        // is past the range top, as for C
+        const uint64_t f = (F_CPU/rg.prescale)*1000ULL,
+                       t = (uint64_t)counts*rg.prescale*1000000/(F_CPU/1000000);
+        const char *const is = over ? ">" : "=";
+        put(l, "seq="); put_uint(l, cap.seq); put(l, ' ');
+        put(l, "us="); put_uint(l, cap.stamp); put(l, ' ');
+        put(l, "ch="); put_uint(l, cap.channel); put(l, ' ');
+        put(l, "r_index="); put_uint(l, cap.r_index); put(l, ' ');
+        put(l, "f="); put_si(l, f, si_milli); put(l, "Hz ");
+        put(l, "t"); put(l, is); put_si(l, t, si_pico); put(l, "s ");
+        put(l, "timer"); put(l, is); put_uint(l, counts); put(l, ' ');
+        if (cap.adc) {
+            put(l, "adc="); put_uint(l, cap.adc); put(l, ' ');
+        }
+        put(l, "R="); put_si(l, rg.mR, si_milli); put(l, "ohm ");
+    }
+
+    print_c(l, cap.channel, C, over);
+    put(l, eol);
+    send_line(l, false);
+}
+
+static void print_burst(const burst &b) {
+    const range &rg = ranges[b.r_index];
+    const float ff_count = rg.scale / (float)(1UL << rg.shift)
+                         * cal[b.channel][b.r_index].gain / 32768.f,
+                mean_d = (float)b.sum / b.count,
+                var = b.count > 1 ? (b.sumsq - b.sum*mean_d) / (b.count - 1) : 0;
+    
+    // Mean as Q8 timer counts, to keep the resolution gained by averaging
+    const uint64_t meanq = ((uint64_t)b.base << 8) + b.sum*256/b.count,
+                   C = zero_cap(b.channel, b.r_index, cal_cap(b.channel, b.r_index, meanq));
+    
+    line l;
+    if (config.verbose) {
+        put(l, "seq="); put_uint(l, b.seq); put(l, ' ');
+        put(l, "us="); put_uint(l, b.stamp); put(l, ' ');
+        put(l, "ch="); put_uint(l, b.channel); put(l, ' ');
+        put(l, "r_index="); put_uint(l, b.r_index); put(l, ' ');
+        put(l, "timer="); put_float(l, meanq/256.f, 2); put(l, ' ');
+        put(l, "R="); put_si(l, rg.mR, si_milli); put(l, "ohm ");
+    }
+    
+    print_c(l, b.channel, C, false);
+    put(l, " s="); put_si(l, to_uint(sqrt(var)*ff_count), si_femto);
+    put(l, "F n="); put_uint(l, b.count);
+    put(l, eol);
+    send_line(l, false);
+}
+
+static void send_cap(const capture &cap) {
+    // On the host, C = (timer - delay - offset)*gain*prescale/F_CPU/ln(5/1.1)/R; see the header
+    uint8_t frame[14] = {
+        sync_sample, (uint8_t)cap.seq, (uint8_t)(cap.seq >> 8),
+        cap.channel, cap.r_index
+    };
+    memcpy(frame+5, &cap.timer, 4);
+    memcpy(frame+9, &cap.stamp, 4);
+    send_frame(frame, sizeof(frame));
+}
+
+static void send_burst(const burst &b) {
+    // Mean is in Q8 timer counts and variance is a float in counts^2
+    const float mean_d = (float)b.sum / b.count,
+                var = b.count > 1 ? (b.sumsq - b.sum*mean_d) / (b.count - 1) : 0;
+    const uint32_t meanq = ((uint32_t)b.base << 8) + b.sum*256/b.count;
+    uint8_t frame[20] = {
+        sync_burst, (uint8_t)b.seq, (uint8_t)(b.seq >> 8),
+        b.channel, b.r_index,
+        (uint8_t)b.count, (uint8_t)(b.count >> 8)
+    };
+    memcpy(frame+7, &meanq, 4);
+    memcpy(frame+11, &var, 4);
+    memcpy(frame+15, &b.stamp, 4);
+    send_frame(frame, sizeof(frame));
+}
+
+static void output_cap(const capture &cap) {
+    if (config.binary)
+        send_cap(cap);
+    else
+        print_cap(cap);
+}
+
+static void burst_flush(burst &acc) {
+    if (!acc.count)
+        return;
+    if (config.binary)
+        send_burst(acc);
+    else
+        print_burst(acc);
+    acc.count = 0;
+}
+
+static void burst_add(const capture &cap) {
+    burst &acc = ::acc[cap.channel];
+    if (cap.timer == timer_overflow) { // nothing to average
+        burst_flush(acc);
+        output_cap(cap);
+        return;
+    }
+    if (acc.count && acc.r_index != cap.r_index) // ranged mid-window
+        burst_flush(acc);
+    
+    if (!acc.count) {
+        /*
+        Size the burst from how long one cycle of this cap takes, charge plus
+        discharge, in timer 3 ticks (F_CPU/256), with a little slack for the
+        ISRs - unless a fixed count is set. A minimum refresh period stretches
+        the cycle.
+        */
+        const range &rg = ranges[cap.r_index];
+        const uint32_t window = (uint32_t)config.burst_ms*(F_CPU/256)/1000,
+                       cycle = (cap.timer*rg.prescale >> 8)
+                             + (cap.timer*rg.dscale >> rg.dshift) + 2,
+                       n = config.burst_n ? config.burst_n :
+                           window/(cycle > config.refresh_ticks ? cycle : config.refresh_ticks);
+        acc.n = n < 1 ? 1 : n > 0xFFFF ? 0xFFFF : n;
+        acc.channel = cap.channel;
+        acc.r_index = cap.r_index;
+        acc.base = cap.timer;
+        acc.sum = 0;
+        acc.sumsq = 0;
+    }
+    
+    const int32_t d = cap.timer - acc.base;
+    acc.sum += d;
+    acc.sumsq += (int64_t)d*d;
+    acc.seq = cap.seq;
+    acc.stamp = cap.stamp;
+    if (++acc.count >= acc.n)
+        burst_flush(acc);
+}
+
+// Report of a full stat_window, in Q8 timer counts
+struct stat_report {
+    uint64_t medianq, meanq; // median, and mean of the middle half
+    float var;               // variance of the middle half, counts^2
+    uint8_t used;            // captures in the middle half
+};
+
+static void print_stats(const stat_window &w, const stat_report &st) {
+    const uint8_t c = w.channel, r = w.r_index;
+    const range &rg = ranges[r];
+    const float ff_count = rg.scale / (float)(1UL << rg.shift)
+                         * cal[c][r].gain / 32768.f;
+    
+    // The median gets the same zeroing as the mean, without updating the baseline twice
+    const uint64_t Cm = cal_cap(c, r, st.meanq),
+                   C = zero_cap(c, r, Cm),
+                   zero = Cm - C,
+                   med = cal_cap(c, r, st.medianq),
+                   C_med = med > zero ? med - zero : 0;
+    
+    line l;
+    if (config.verbose) {
+        put(l, "seq="); put_uint(l, w.seq); put(l, ' ');
+        put(l, "us="); put_uint(l, w.stamp); put(l, ' ');
+        put(l, "ch="); put_uint(l, c); put(l, ' ');
+        put(l, "r_index="); put_uint(l, r); put(l, ' ');
+        put(l, "timer="); put_float(l, st.meanq/256.f, 2); put(l, ' ');
+        put(l, "R="); put_si(l, rg.mR, si_milli); put(l, "ohm ");
+    }
+    
+    print_c(l, c, C, false);
+    put(l, " m="); put_si(l, C_med, si_femto);
+    put(l, "F s="); put_si(l, to_uint(sqrt(st.var)*ff_count), si_femto);
+    put(l, "F n="); put_uint(l, w.count);
+    put(l, eol);
+    send_line(l, false);
+}
+
+static void send_stats(const stat_window &w, const stat_report &st) {
+    // Median and mean are in Q8 timer counts and variance is a float in counts^2
+    const uint32_t medianq = st.medianq, meanq = st.meanq;
+    uint8_t frame[23] = {
+        sync_stats, (uint8_t)w.seq, (uint8_t)(w.seq >> 8),
+        w.channel, w.r_index, w.count
+    };
+    memcpy(frame+6, &medianq, 4);
+    memcpy(frame+10, &meanq, 4);
+    memcpy(frame+14, &st.var, 4);
+    memcpy(frame+18, &w.stamp, 4);
+    send_frame(frame, sizeof(frame));
+}
+
+static void stat_reset(stat_window &w) {
+    w.count = 0;
+    w.next = 0;
+    w.since = 0;
+}
+
+static void stat_insert(stat_window &w, uint32_t timer) {
+    uint8_t n = w.count;
+    if (n == config.stat_n) { // full: the oldest makes way
+        const uint32_t old = w.timers[w.next];
+        uint8_t i = 0;
+        while (w.sorted[i] != old)
+            i++;
+        memmove(w.sorted + i, w.sorted + i+1, (n-1 - i)*sizeof(*w.sorted));
+        n--;
+    }
+    uint8_t i = n;
+    for (; i && w.sorted[i-1] > timer; i--)
+        w.sorted[i] = w.sorted[i-1];
+    w.sorted[i] = timer;
+    w.count = n+1;
+    w.timers[w.next] = timer;
+    if (++w.next == config.stat_n)
+        w.next = 0;
+}
+
+static void stat_add(const capture &cap) {
+    stat_window &w = stats[cap.channel];
+    if (cap.timer == timer_overflow) {
+        // Nothing to add, and only a reading if there's no coarser range left to try
+        stat_reset(w);
+        if (cap.r_index == 0 || chans[cap.channel].r_lock != 0xFF)
+            output_cap(cap);
+        return;
+    }
+    if (w.count && w.r_index != cap.r_index) // ranged; start over
+        stat_reset(w);
+    
+    w.channel = cap.channel;
+    w.r_index = cap.r_index;
+    w.seq = cap.seq;
+    w.stamp = cap.stamp;
+    stat_insert(w, cap.timer);
+    if (w.since < config.stat_n)
+        w.since++;
+    if (w.since < config.stat_n)
+        return;
+    
+    // Middle half, in offsets from its smallest to keep the sums exact
+    const uint8_t n = w.count, trim = n/4;
+    stat_report st;
+    st.used = n - 2*trim;
+    const uint32_t base = w.sorted[trim];
+    uint32_t sum = 0;
+    uint64_t sumsq = 0;
+    for (uint8_t i = trim; i < n - trim; i++) {
+        const uint32_t d = w.sorted[i] - base;
+        sum += d;
+        sumsq += (uint64_t)d*d;
+    }
+    const float mean_d = (float)sum / st.used;
+    st.var = (sumsq - sum*mean_d) / (st.used - 1);
+    st.meanq = ((uint64_t)base << 8) + ((uint64_t)sum << 8)/st.used;
+    st.medianq = ((uint64_t)w.sorted[(n-1)/2] + w.sorted[n/2]) << 7;
+    
+    // Settled once the spread is within stat_ppm of the mean, or within a count
+    if (config.stat_ppm) {
+        const float tol = st.meanq/256.f * config.stat_ppm * 1e-6f;
+        if (st.var > tol*tol && st.var > 1)
+            return;
+    }
+    w.since = 0;
+    if (config.binary)
+        send_stats(w, st);
+    else
+        print_stats(w, st);
+}
+
+static uint16_t cal_crc(const cal_image &im) {
+    const uint8_t *p = (const uint8_t*)&im;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < offsetof(cal_image, crc); i++)
+        crc = _crc16_update(crc, p[i]);
+    return crc;
+}
+
+static void setup_cal() {
+    /*
+    Load the calibration saved by cal_save(), or start with none: no offset
+    and unity gain. A loaded calibration has the empty-socket offsets in it
+    already, so zero tracking starts from there instead of waiting for its
+    first reading.
+    */
+    cal_image im;
+    eeprom_read_block(&im, cal_addr, sizeof(im));
+    cal_loaded = im.magic == cal_magic && im.channels == n_sockets &&
+                 im.ranges == n_ranges && im.crc == cal_crc(im);
+    for (uint8_t c = 0; c < n_sockets; c++) {
+        for (uint8_t r = 0; r < n_ranges; r++) {
+            cal[c][r].offset = cal_loaded ? im.entry[c][r].offset : 0;
+            cal[c][r].gain = cal_loaded ? im.entry[c][r].gain : 32768;
+        }
+        zeros[c].valid = cal_loaded;
+    }
+}
+
+static void cal_save() {
+    /*
+    EEPROM, ch8.4. Only the bytes that changed are written, but each takes
+    3.3ms, during which loop() waits; acquisition carries on from the ISRs,
+    and anything that doesn't fit in the ring meanwhile is dropped.
+    */
+    cal_image im;
+    memset(&im, 0, sizeof(im));
+    im.magic = cal_magic;
+    im.channels = n_sockets;
+    im.ranges = n_ranges;
+    memcpy(im.entry, cal, sizeof(cal));
+    im.crc = cal_crc(im);
+    eeprom_update_block(&im, cal_addr, sizeof(im));
+    cal_loaded = true;
+}
+
+static void cal_report() {
+    if (config.binary) {
+        send_header();
+        return;
+    }
+    for (uint8_t c = 0; c < n_sockets; c++)
+        for (uint8_t r = 0; r < n_ranges; r++) {
+            line l;
+            put(l, c || r ? "Cal " : "\nCal "); put_uint(l, c);
+            put(l, " range "); put_uint(l, r);
+            put(l, ": offset "); put_float(l, cal[c][r].offset/256.f, 2);
+            put(l, " gain "); put_float(l, cal[c][r].gain/32768.f, 5);
+            put(l, "\r\n");
+            send_line(l, true);
+        }
+}
+
+static void cal_start(uint64_t ref) {
+    /*
+    With ref 0, the sockets must be empty, and each range is locked in turn
+    to measure its offset, finest first. Otherwise each socket has a reference
+    part of ref fF in, and the range it settles on gets the gain that makes it
+    read true; see cal_add().
+    */
+    cal_ref = ref;
+    cal_state = ref ? CAL_GAIN : CAL_OFFSET;
+    for (uint8_t c = 0; c < n_sockets; c++) {
+        cal_acc &a = cal_accs[c];
+        a.r_index = ref ? 0xFF : n_ranges-1;
+        a.n = 0;
+        a.done = false;
+        chans[c].r_lock = ref ? config.r_lock : n_ranges-1;
+    }
+}
+
+static void cal_end(uint8_t c, const char *failed) {
+    cal_accs[c].done = true;
+    chans[c].r_lock = config.r_lock;
+    if (failed && !config.binary) {
+        line l;
+        put(l, "\nCal "); put_uint(l, c);
+        put(l, " failed: "); put(l, failed); put(l, "\r\n");
+        send_line(l, true);
+    }
+    
+    for (uint8_t i = 0; i < n_sockets; i++)
+        if (!cal_accs[i].done)
+            return;
+    cal_state = CAL_IDLE;
+    cal_save();
+    cal_report();
+}
+
+static void cal_add(const capture &cap) {
+    /*
+    Average cal_n captures on one range, skipping the first, which may have
+    started before the range was locked or the part went in. A gain is only
+    taken if it's within a factor of two of unity, and it applies to every
+    range on the same resistor, since that's where the error comes from.
+    */
+    const uint8_t c = cap.channel;
+    cal_acc &a = cal_accs[c];
+    if (a.done)
+        return;
+    if (cap.timer == timer_overflow) {
+        if (cal_state == CAL_OFFSET)
+            cal_end(c, "socket not empty");
+        a.n = 0;
+        return;
+    }
+    if (cap.r_index != a.r_index) { // not locked yet, or still autoranging
+        if (cal_state == CAL_GAIN)
+            a.r_index = cap.r_index;
+        a.n = 0;
+        return;
+    }
+    if (!a.n++) {
+        a.sum = 0;
+        return;
+    }
+    a.sum += cap.timer;
+    if (a.n <= cal_n)
+        return;
+    
+    const uint8_t r = a.r_index;
+    const range &rg = ranges[r];
+    const uint64_t meanq = ((uint64_t)a.sum << 8)/cal_n;
+    if (cal_state == CAL_OFFSET) {
+        if (r == n_ranges-1 && (meanq*rg.scale >> (rg.shift + 8)) >= zero_max) {
+            cal_end(c, "socket not empty");
+            return;
+        }
+        cal[c][r].offset = meanq - rg.delay; // as cal_cap() takes them off
+        if (r > 0) {
+            a.r_index = chans[c].r_lock = r-1;
+            a.n = 0;
+            return;
+        }
+        zeros[c].base = 0; // the offsets have it now
+        zeros[c].valid = true;
+        cal_end(c, 0);
+    }
+    else {
+        const int64_t t = (int64_t)meanq - rg.delay - cal[c][r].offset;
+        const uint64_t measured = t > 0 ? (uint64_t)t*rg.scale >> (rg.shift + 8) : 0,
+                       gain = measured ? (cal_ref << 15)/measured : 0;
+        if (gain < 16384 || gain > 0xFFFF) {
+            cal_end(c, "reading too far from the reference");
+            return;
+        }
+        for (uint8_t i = 0; i < n_ranges; i++)
+            if (ranges[i].pin_mask == rg.pin_mask)
+                cal[c][i].gain = gain;
+        cal_end(c, 0);
+    }
+}
+
+#if DISCHARGE_ADC
+static void stop_watch() {
+    // Back to discharging through all three pins, and ADC off
+    const channel &ch = socket_of(watching);
+    *ch.ddr  |= ch.adc_float << ch.shift;
+    *ch.port |= ch.adc_float << ch.shift;
+    ADCSRA = (0 << ADEN) | // Disable ADC
+             (1 << ADIF);  // "clear" the ADC interrupt flag
+    PRR0 |= 1 << PRADC;    // Turn off power for the ADC
+    watching = 0xFF;
+}
+
+static void start_watch(uint8_t c) {
+    /*
+    ADC: ch26, p268. Single conversions, restarted from the ADC ISR until the
+    node is back near 5V. Referenced to AVCC, so it's ratiometric with the 5V
+    the cap is tied to. /128 prescaler for a 125kHz ADC clock, the fastest
+    that gives full 10-bit accuracy; 13 cycles (25 for the first) per
+    conversion.
+    */
+    if (watching != 0xFF)
+        stop_watch(); // only one at a time; that one falls back to its timer
+    const channel &ch = socket_of(c);
+    *ch.ddr  &= ~(ch.adc_float << ch.shift); // Float the read pin, no pullup
+    *ch.port &= ~(ch.adc_float << ch.shift);
+    watching = c;
+    
+    PRR0 &= ~(1 << PRADC); // Turn on power for the ADC
+    ADMUX = (B01 << REFS0) | // AVCC reference
+            (0 << ADLAR)   | // right-adjusted, full 10 bits
+            ((ch.adc & B111) << MUX0);
+    ADCSRB = (ADCSRB & ~(1 << MUX5)) | ((ch.adc >> 3) << MUX5);
+    ADCSRA = (1 << ADEN)  | // Enable ADC
+             (1 << ADSC)  | // start conversion
+             (0 << ADATE) | // no auto-trigger
+             (1 << ADIF)  | // "clear" the ADC interrupt flag
+             (1 << ADIE)  | // enable ADC interrupt
+             (B111 << ADPS0); // /128 prescaler
+}
+#endif
+
+#if SLOPE_ADC
+static void stop_slope() {
+    ADCSRA = (0 << ADEN) | // Disable ADC
+             (1 << ADIF);  // "clear" the ADC interrupt flag
+    ADCSRB &= ~(B111 << ADTS0); // no trigger
+    PRR0 |= 1 << PRADC;    // Turn off power for the ADC
+    sampling = false;
+}
+
+static void start_slope(const channel &ch) {
+    /*
+    ADC: ch26, auto-triggered by the timer 1 capture event (table 26-6), so
+    the sample-and-hold is 2 ADC clocks and 3 cycles after the comparator
+    trips (fig 26-7): slope_delay. /64 for a 250kHz ADC clock, just over the
+    200kHz for full accuracy, to keep that delay short. The first conversion
+    after enabling holds at 13.5 ADC clocks instead, so run it now: it's done
+    long before a charge of slope_cycles trips.
+    */
+    PRR0 &= ~(1 << PRADC); // Turn on power for the ADC
+    ADMUX = (B01 << REFS0) | // AVCC reference
+            (0 << ADLAR)   | // right-adjusted, full 10 bits
+            ((ch.adc & B111) << MUX0);
+    ADCSRB = (ADCSRB & ~(1 << MUX5) & ~(B111 << ADTS0)) |
+             ((ch.adc >> 3) << MUX5) |
+             (B111 << ADTS0); // trigger on timer 1 capture
+    sampled_timer = 0;
+    ADCSRA = (1 << ADEN)  | // Enable ADC
+             (1 << ADSC)  | // warm-up conversion
+             (1 << ADATE) | // then auto-trigger
+             (1 << ADIF)  | // "clear" the ADC interrupt flag
+             (1 << ADIE)  | // enable ADC interrupt
+             (B110 << ADPS0); // /64 prescaler
+    sampling = true;
+}
+#endif
+
+#if WAVEFORM
+static void start_wave(const channel &ch) {
+    // ADC free-running (table 26-6), each conversion kept or not by the ADC ISR
+    PRR0 &= ~(1 << PRADC); // Turn on power for the ADC
+    ADMUX = (B01 << REFS0) | // AVCC reference
+            (0 << ADLAR)   | // right-adjusted, full 10 bits
+            ((ch.adc & B111) << MUX0);
+    ADCSRB = (ADCSRB & ~(1 << MUX5) & ~(B111 << ADTS0)) |
+             ((ch.adc >> 3) << MUX5); // free running
+    wave_len = 0;
+    wave_div = 1; // keep the first
+    ADCSRA = (1 << ADEN)  | // Enable ADC
+             (1 << ADSC)  | // start converting
+             (1 << ADATE) | // and keep on
+             (1 << ADIF)  | // "clear" the ADC interrupt flag
+             (1 << ADIE)  | // enable ADC interrupt
+             (wave_adps << ADPS0);
+    wave_start = (uint32_t)TCNT1*ranges[chans[active].r_index].prescale;
+    wave_step = WAVE_RUNNING;
+}
+
+static void stop_wave(uint32_t timer) {
+    ADCSRA = (0 << ADEN) | // Disable ADC
+             (1 << ADIF);  // "clear" the ADC interrupt flag
+    PRR0 |= 1 << PRADC;    // Turn off power for the ADC
+    wave_timer = timer;
+    wave_seq = seq;
+    wave_r = chans[active].r_index;
+    wave_step = WAVE_DONE;
+}
+#endif
+
 static void charge() {
-    DDRF = ranges[r_index].pin_mask; // All inputs except current R
+    /*
+    Only this channel's three pins are changed; the port may be shared with
+    another channel that is still discharging.
+    */
+    PROFILE_BEGIN(PROF_CHARGE);
+    const channel &ch = channels[active];
+    const uint8_t pins = B111 << ch.shift;
+    
+    // Comparator on first: its output can glitch as it powers up, and a
+    // glitch inside start_capture() would be taken as the trip. Everything
+    // up to there is well over its 0.5us settling time (ch31.8).
+    ACSR &= ~(1 << ACD);
+    
+    // With the ADC on, the comparator can't use the ADC mux, and our own
+    // pins are about to change, so either way stop watching
+    #if DISCHARGE_ADC
+    if (watching != 0xFF && (watching == active || ch.mux != 0xFF))
+        stop_watch();
+    #endif
+    
+    if (ch.mux == 0xFF)
+        ADCSRB &= ~(1 << ACME); // comptor- connected to AIN1
+    else {
+        ADMUX = (ADMUX & ~B111) | (ch.mux & B111);
+        ADCSRB = (ADCSRB & ~(1 << MUX5)) |
+                 ((ch.mux >> 3) << MUX5) |
+                 (1 << ACME);   // comptor- connected to the ADC mux
+    }
+    
+    // All inputs except current R
+    const uint8_t drive = ranges[chans[active].r_index].pin_mask;
+    *ch.ddr = (*ch.ddr & ~pins) | (drive << ch.shift);
     
-    // reset the timer value
+    #if SLOPE_ADC
+    // The other pins float, so the ADC can read the node through adc_float
+    if (chans[active].slope && ch.mux == 0xFF && !(drive & ch.adc_float)) {
+        #if DISCHARGE_ADC
+        if (watching != 0xFF)
+            stop_watch();
+        #endif
+        start_slope(ch);
+    }
+    #endif
+    
+    // reset the timer value, and note the time to within a few us
+    charge_us = epoch_now(epoch_us_shift);
     start_capture();
+    charging = true;
+    #if WAVEFORM
+    // wave_plan() has checked the range; the waveform takes the ADC from either
+    if (wave_step == WAVE_READY && active == 0) {
+        #if SLOPE_ADC
+        if (sampling)
+            stop_slope();
+        #endif
+        #if DISCHARGE_ADC
+        if (watching != 0xFF)
+            stop_watch();
+        #endif
+        start_wave(ch);
+    }
+    #endif
     
     // Start charging the cap
-    // 1: unused pins that stay as pullups
     // 0: either input-no-pullup, or sinking for current R to charge
-    PORTF = B11111000;
+    *ch.port &= ~pins;
+    PROFILE_END(PROF_CHARGE);
 }
 
-static void discharge() {
-    DDRF = B00000111; // PF0-2 set to output discharge; others unused
-    PORTF = 0xFF;     // All pullups or sourcing
+static void drain(const channel &ch) {
+    const uint8_t pins = B111 << ch.shift;
+    *ch.ddr  |= pins; // Set to output discharge
+    *ch.port |= pins; // Sourcing
+}
 
+static void discharge() {
+    PROFILE_BEGIN(PROF_DISCHARGE);
+    drain(channels[active]);
     stop_capture();
+    PROFILE_END(PROF_DISCHARGE);
 }
 
-static void rerange(uint16_t timer) {
-    if (timer == 0xFFFF) { // overflow
-        if (r_index > 0)
-            r_index--;
+#if ICP5_SOCKET
+static void charge5() {
+    // As charge(), without the comparator to set up
+    const channel &ch = icp5_channel;
+    const uint8_t pins = B111 << ch.shift;
+    #if DISCHARGE_ADC
+    if (watching == icp5_chan)
+        stop_watch();
+    #endif
+    const uint8_t drive = ranges[chans[icp5_chan].r_index].pin_mask;
+    *ch.ddr = (*ch.ddr & ~pins) | (drive << ch.shift);
+    charge5_us = epoch_now(epoch_us_shift);
+    start_capture5();
+    charging5 = true;
+    *ch.port &= ~pins;
+}
+
+static void discharge5() {
+    drain(icp5_channel);
+    stop_capture5();
+}
+#endif
+
+static uint32_t refresh_now() {
+    // Timer 3 extended to 32 bits; call with interrupts disabled
+    const uint16_t tcnt = TCNT3;
+    uint16_t high = refresh_high;
+    if ((TIFR3 & (1 << TOV3)) && tcnt < 0x8000) // overflow not yet counted
+        high++;
+    return (uint32_t)high << 16 | tcnt;
+}
+
+static void wdt_start(uint8_t wdp) {
+    // Interrupt-only watchdog, ch12.5; call with interrupts disabled
+    wdt_reset();
+    MCUSR &= ~(1 << WDRF);
+    WDTCSR = (1 << WDCE) | (1 << WDE); // timed sequence: 4 cycles to change
+    WDTCSR = (1 << WDIF) | (1 << WDIE) | // interrupt, no reset
+             ((wdp >> 3) << WDP3) | ((wdp & B111) << WDP0);
+}
+
+static void wdt_stop() {
+    WDTCSR = (1 << WDCE) | (1 << WDE);
+    WDTCSR = 0;
+}
+
+static void setup_sleep() {
+    // The watchdog ISR measures its period against timer 3, which is already running
+    wdt_start(wdt_cal_wdp);
+    wdt_cal_start = refresh_now();
+}
+
+static void clocks_forward(uint32_t ticks) {
+    /*
+    Timers 3 and 4 stood still while asleep: move them and their overflow
+    counts on by ticks of timer 3 (256 cycles). Call with interrupts disabled.
+    */
+    const uint32_t t3 = refresh_now() + ticks;
+    TCNT3 = t3;
+    refresh_high = t3 >> 16;
+    TIFR3 = 1 << TOV3; // counted
+    
+    const uint16_t tcnt = TCNT4;
+    uint32_t high = epoch_high;
+    if ((TIFR4 & (1 << TOV4)) && tcnt < 0x8000)
+        high++;
+    const uint32_t add = ticks << (8 - 4 + epoch_us_shift), // timer 4 counts
+                   low = tcnt + (add & 0xFFFF);
+    TCNT4 = low;
+    epoch_high = high + (add >> 16) + (low >> 16);
+    TIFR4 = 1 << TOV4;
+}
+
+static uint8_t pick_sleep(uint8_t *wdp) {
+    /*
+    The deepest sleep allowed right now, with interrupts disabled, and for a
+    deep one, the longest watchdog period that wakes an eighth of the wait early
+    */
+    if (!config.low_power || !wdt_cal_ticks || deep || charging ||
+        watching != 0xFF || sampling || tx_head != tx_tail ||
+        (tx_used && !(UCSR0A & (1 << TXC0))) ||
+        epoch_now(epoch_us_shift) - rx_last_us < sleep_rx_us)
+        return SLEEP_IDLE;
+    int32_t wait = alarm_at - refresh_now();
+    #if ICP5_SOCKET
+    if (charging5)
+        return SLEEP_IDLE;
+    const int32_t wait5 = alarm5_at - refresh_now();
+    if (wait5 < wait)
+        wait = wait5;
+    #endif
+    for (int8_t p = 9; p >= 0; p--) {
+        const uint32_t period = (uint32_t)wdt_cal_ticks << p >> wdt_cal_wdp;
+        const uint8_t kind = period >= 16UL*sleep_start_ticks[SLEEP_POWER_DOWN] ?
+                             SLEEP_POWER_DOWN : SLEEP_STANDBY;
+        const uint32_t need = period + period/8 + sleep_start_ticks[kind];
+        if (wait > 0 && need <= (uint32_t)wait) {
+            *wdp = p;
+            deep_ticks = period + sleep_start_ticks[kind];
+            return kind;
+        }
+    }
+    return SLEEP_IDLE;
+}
+
+static void sleep_next() {
+    // Sleep until the next interrupt, as deeply as pick_sleep() allows; call
+    // with interrupts disabled, and they're enabled on return
+    uint8_t wdp;
+    const uint8_t kind = pick_sleep(&wdp);
+    if (kind > sleep_deepest)
+        sleep_deepest = kind;
+    if (kind == SLEEP_IDLE) {
+        sleep_stats[kind].sleeps++;
+        sei();       // sei guarantees the next instruction runs,
+        sleep_cpu(); // so a capture can't slip in before we sleep
+        return;
+    }
+    
+    deep = kind;
+    deep_early = false;
+    sleep_stats[kind].sleeps++;
+    wdt_start(wdp);
+    PCMSK1 |= 1 << PCINT8; // RXD0
+    PCIFR = 1 << PCIF1;
+    PCICR |= 1 << PCIE1;
+    SMCR = (sleep_sm[kind] << SM0) | (1 << SE);
+    sei();
+    sleep_cpu();
+    
+    cli();
+    SMCR = (sleep_sm[SLEEP_IDLE] << SM0) | (1 << SE);
+    PCICR &= ~(1 << PCIE1);
+    if (deep) { // something else woke us; the watchdog ISR will credit the rest
+        deep_early = true;
+        deep_woke = refresh_now();
+    }
+    sei();
+}
+
+static void sleep_report() {
+    // Takes a snapshot and starts over, as prof_report() does
+    static const char *const names[n_sleeps] = {"idle", "standby", "power-down"};
+    sleep_stat snap[n_sleeps];
+    cli();
+    memcpy(snap, sleep_stats, sizeof(sleep_stats));
+    memset(sleep_stats, 0, sizeof(sleep_stats));
+    sei();
+    
+    line head;
+    put(head, "\nsleep n deep_ms charges late_max late_mean (us)\r\n");
+    send_line(head, true);
+    for (uint8_t k = 0; k < n_sleeps; k++) {
+        const sleep_stat &st = snap[k];
+        line l;
+        put(l, names[k]); put(l, ' ');
+        put_uint(l, st.sleeps); put(l, ' ');
+        put_uint(l, (uint64_t)st.ticks*256*1000/F_CPU); put(l, ' ');
+        put_uint(l, st.charges); put(l, ' ');
+        put_uint(l, (uint32_t)st.late_max*256/(F_CPU/1000000)); put(l, ' ');
+        put_float(l, st.charges ? (float)st.late_sum*256/(F_CPU/1000000)/st.charges : 0, 1);
+        put(l, "\r\n");
+        send_line(l, true);
+    }
+}
+
+static void range_report() {
+    // Takes a snapshot and starts over, as sleep_report() does
+    range_stat snap[n_sockets];
+    cli();
+    memcpy(snap, range_stats, sizeof(range_stats));
+    memset(range_stats, 0, sizeof(range_stats));
+    sei();
+    
+    line head;
+    put(head, "\nsocket finer coarser overflows flaps held\r\n");
+    send_line(head, true);
+    for (uint8_t c = 0; c < n_sockets; c++) {
+        const range_stat &st = snap[c];
+        line l;
+        put_uint(l, c); put(l, ' ');
+        put_uint(l, st.finer); put(l, ' ');
+        put_uint(l, st.coarser); put(l, ' ');
+        put_uint(l, st.overflows); put(l, ' ');
+        put_uint(l, st.flaps); put(l, ' ');
+        put_uint(l, st.held);
+        put(l, "\r\n");
+        send_line(l, true);
+    }
+}
+
+static void start_next(bool alarm = false) {
+    /*
+    Charge the next channel round-robin from the last one measured that has
+    finished discharging, so that one channel's charge overlaps the last one's
+    discharge. If none is ready, set the compare alarm for the soonest. The
+    alarm only sees the low 16 bits, so one more than a timer period away will
+    go off early and just be set again.
+    */
+    for (;;) {
+        const uint32_t now = refresh_now();
+        int32_t wait = 0x7FFFFFFF;
+        for (uint8_t i = 1; i <= CHANNELS; i++) {
+            const uint8_t c = (active + i) % CHANNELS;
+            const int32_t w = chans[c].due - now;
+            if (w <= 0) {
+                if (alarm) { // how late the sleep let this one start
+                    sleep_stat &st = sleep_stats[sleep_deepest];
+                    st.charges++;
+                    st.late_sum -= w;
+                    if (-w > st.late_max)
+                        st.late_max = -w > 0xFFFF ? 0xFFFF : -w;
+                }
+                sleep_deepest = SLEEP_IDLE;
+                active = c;
+                charge();
+                return;
+            }
+            if (w < wait)
+                wait = w;
+        }
+        
+        OCR3A = now + wait;
+        TIFR3 = 1 << OCF3A; // "clear" any stale match
+        alarm_at = now + wait;
+        if ((int32_t)(refresh_now() - now) < wait)
+            return; // otherwise the alarm was set too late to catch; retry
     }
-    else { // increase for better resolution
-        if (timer < ranges[r_index].min)
-            r_index++; 
+}
+
+#if DISCHARGE_ADC
+static bool adc_free(uint8_t c) {
+    // Timer 1's sockets only ask between their own charges; the ICP5 socket
+    // mustn't take the ADC from one under way that's using it or its mux
+    #if ICP5_SOCKET
+    if (c == icp5_chan && charging) {
+        #if WAVEFORM
+        if (wave_step == WAVE_RUNNING)
+            return false;
+        #endif
+        return channels[active].mux == 0xFF && !sampling;
+    }
+    #endif
+    (void)c;
+    return true;
+}
+#endif
+
+#if ICP5_SOCKET
+static void start_next5() {
+    // The ICP5 socket's own start_next(), on compare B
+    for (;;) {
+        const uint32_t now = refresh_now();
+        const int32_t wait = chans[icp5_chan].due - now;
+        if (wait <= 0) {
+            charge5();
+            return;
+        }
+        OCR3B = now + wait;
+        TIFR3 = 1 << OCF3B;
+        alarm5_at = now + wait;
+        if ((int32_t)(refresh_now() - now) < wait)
+            return;
+    }
+}
+#endif
+
+static void schedule_refresh(uint8_t c, uint32_t timer) {
+    /*
+    Discharge is through all three resistors in parallel, starting from the
+    3.9V left on the cap when the comparator trips. Wait until the cap is
+    down to a residual of 10mV, which biases the next measurement by about
+    0.01/5/ln(5/1.1) ~ 0.13%.
+    t_dis = Rd*C*taud, C = t_chg/taus/R, t_chg = timer*prescale/F_CPU
+    The per-range factor is precomputed as dscale/dshift, in timer 3 ticks.
+    Two ticks are added: one to round up, and one because the current tick
+    may be nearly over.
+    This runs from the capture ISRs, so interrupts are already disabled.
+    */
+    chan_state &cs = chans[c];
+    const range &rg = ranges[cs.r_index];
+    uint32_t ticks;
+    if (timer == timer_overflow) // we don't know how big the cap is
+        ticks = 31250;   // so fall back to 500ms * 16e6 / 256
+    else
+        ticks = (timer*rg.dscale >> rg.dshift) + 2;
+    
+    #if DISCHARGE_ADC
+    /*
+    If the wait is longer than a couple of conversions, and than the refresh
+    period, have the ADC end it as soon as the cap is actually discharged; the
+    timed wait, doubled, is only a backstop in case the ADC is taken by
+    another channel.
+    */
+    if (ticks > 16 && ticks > config.refresh_ticks && adc_free(c)) { // 256us, or the period
+        start_watch(c);
+        ticks *= 2;
+    }
+    #endif
+    
+    // The refresh period runs from one capture to the next, so the next
+    // charge time comes out of it
+    const uint32_t charge = timer == timer_overflow ? 0 : timer*rg.prescale >> 8,
+                   hold = config.refresh_ticks > charge ? config.refresh_ticks - charge : 0,
+                   now = refresh_now();
+    cs.held = now + hold;
+    cs.due = now + (ticks > hold ? ticks : hold);
+}
+
+static bool reads_empty(const range &rg, uint32_t timer) {
+    // A couple of counts of latency can be more than zero_max on coarse ranges
+    return timer <= 2 || ((uint64_t)timer*rg.scale >> rg.shift) < zero_max;
+}
+
+static void move_range(uint8_t c, uint8_t r) {
+    // Every autoranging move comes through here, for the counters
+    chan_state &cs = chans[c];
+    range_stat &st = range_stats[c];
+    const int8_t dir = r > cs.r_index ? 1 : -1;
+    if (dir > 0)
+        st.finer++;
+    else
+        st.coarser++;
+    if (cs.r_dir == -dir)
+        st.flaps++;
+    cs.r_dir = dir;
+    cs.r_index = r;
+    cs.r_votes = 0;
+}
+
+static void rerange(uint8_t c, uint32_t timer) {
+    chan_state &cs = chans[c];
+    if (cs.r_lock != 0xFF) {
+        cs.r_index = cs.r_lock;
+        return;
+    }
+    const uint8_t h = config.hint_r;
+    if (h != 0xFF) {
+        /*
+        With a hint, go straight to its range, and back to it whenever the
+        socket reads empty or a part overflows a finer range, so that each new
+        part's first reading is on the hint's range. From there, a part that
+        doesn't fit it autoranges as usual.
+        */
+        const bool back = timer == timer_overflow ? cs.r_index > h
+                                                  : reads_empty(ranges[cs.r_index], timer);
+        if (!cs.hinted || back) {
+            cs.hinted = true;
+            if (cs.r_index != h)
+                move_range(c, h);
+            return;
+        }
+    }
+    if (timer == timer_overflow) {
+        /*
+        The cap is too big for this range and every finer one. Bisect between
+        here and the finest range that has recently given a valid capture,
+        leaning toward the finer half for better resolution.
+        */
+        if (cs.r_index == 0)
+            return;
+        uint8_t hi = cs.r_index - 1;
+        if (cs.r_valid > hi) // stale - the part must have been swapped
+            cs.r_valid = 0;
+        range_stats[c].overflows++;
+        move_range(c, (cs.r_valid + hi + 1)/2);
+        return;
+    }
+    
+    /*
+    Predict what the timer would read in each finer range and jump straight
+    to the finest one that won't come near overflowing. Since t < grow, t*up
+    stays inside 32 bits. Failing that, a capture near overflowing moves one
+    range coarser before it does.
+    */
+    cs.r_valid = cs.r_index;
+    const range &rg = ranges[cs.r_index];
+    uint8_t r = cs.r_index;
+    uint32_t t = timer;
+    while (r < n_ranges-1 && t < ranges[r].grow) {
+        t = t*ranges[r].up >> 8;
+        r++;
+    }
+    if (r == cs.r_index && r > 0 && timer > rg.shrink)
+        r--;
+    
+    /*
+    A move the capture only just calls for, inside a band's width of the
+    threshold, has to be asked for by RANGE_CONFIRM captures in a row, so that
+    noise on a part sitting at the threshold can't flip it back and forth.
+    Anything further out, such as a part being swapped, moves at once.
+    */
+    if (r == cs.r_index || r != cs.r_next) {
+        if (cs.r_votes)
+            range_stats[c].held++;
+        cs.r_votes = 0;
+    }
+    if (r == cs.r_index)
+        return;
+    cs.r_next = r;
+    cs.r_votes++;
+    const bool clear = r > cs.r_index && timer < rg.grow - rg.min/range_band;
+    if (clear || cs.r_votes >= RANGE_CONFIRM) {
+        move_range(c, r);
     }
 }
 
@@ -287,41 +2239,707 @@ void setup() {
     setup_ports();
     setup_comptor();
     setup_capture();
+    #if ICP5_SOCKET
+    setup_capture5();
+    #endif
     setup_refresh();
+    setup_cal();
+    setup_epoch();
+    setup_sleep();
     setup_serial();
+    #if PROFILE
+    setup_profile();
+    #endif
     sei(); // re-enable interrupts
 }
 
+/*
+Commands over serial: a capital letter and an optional value, ended by CR, LF,
+space or ';'. A value is digits with an optional decimal point; K also takes
+an f/p/n/u/m suffix, as does C, and without one they're in pF.
+    Z       re-zero every socket from its next finest-range reading
+    K[C]    calibrate for a reference of C, 0 for empty; alone, show it
+    R[n]    lock every socket to range n; alone, autorange
+    C[C]    expect parts of about C, and start each on its range; alone, don't
+    F<ms>   shortest time between captures on a socket; 0 for no limit
+    W<ms>   burst window; 0 for no bursts
+    N<n>    captures per burst instead of sizing by W; 0 to size by W
+    M<n>    statistics window, 3 to 16 captures; 0 for none
+    S<ppm>  spread a statistics window must settle to; 0 to report every one
+    A, B    ASCII or binary output
+    V[0|1]  verbose off or on; alone, toggle
+    U[baud] switch baud rate, then confirm with U alone at the new rate
+    L[0|1]  deep sleep between captures off or on; alone, sleep report
+    H       binary header, or in ASCII, the settings as commands
+    T       autoranging report: range moves per socket since the last one
+    G       record the next charge on socket 0 and fit it, in WAVEFORM builds
+    P       profiling report, in PROFILE builds
+*/
+struct command {
+    char op; // 0 while waiting for one
+    bool digits, point, suffix, bad;
+    uint8_t decimals;
+    uint64_t value;
+    uint64_t unit; // fF per unit of a K value
+};
+static const uint64_t value_max = ~(uint64_t)0;
+
+static void bursts_flush() {
+    for (uint8_t c = 0; c < n_sockets; c++)
+        burst_flush(acc[c]);
+}
+
+static void show_settings() {
+    line l;
+    put(l, "\nV"); put_uint(l, config.verbose);
+    put(l, " A W"); put_uint(l, config.burst_ms);
+    put(l, " N"); put_uint(l, config.burst_n);
+    put(l, " M"); put_uint(l, config.stat_n);
+    put(l, " S"); put_uint(l, config.stat_ppm);
+    put(l, " F"); put_uint(l, config.refresh_ms);
+    put(l, " U"); put_uint(l, config.baud);
+    put(l, " L"); put_uint(l, config.low_power);
+    put(l, " R");
+    if (config.r_lock != 0xFF)
+        put_uint(l, config.r_lock);
+    put(l, " C");
+    if (config.hint)
+        put_si(l, config.hint, si_femto);
+    put(l, "\r\n");
+    send_line(l, true);
+}
+
+static uint8_t hint_range(uint64_t C) {
+    // Finest range whose capture of C fF leaves an eighth of it spare for tolerance
+    for (uint8_t r = n_ranges-1; r > 0; r--) {
+        const range &rg = ranges[r];
+        const float t = (float)C * (float)(1UL << rg.shift) / rg.scale,
+                    top = (uint32_t)(rg.max_ovf + 1) << 16;
+        if (t < top*7/8)
+            return r;
+    }
+    return 0;
+}
+
+static void set_hint(uint64_t C) {
+    cli();
+    config.hint = C;
+    config.hint_r = C ? hint_range(C) : 0xFF;
+    for (uint8_t c = 0; c < n_sockets; c++)
+        chans[c].hinted = false; // takes effect after each socket's next capture
+    sei();
+}
+
+static void show_baud(uint32_t baud) {
+    // In binary, a header is the reply
+    if (config.binary) {
+        send_header();
+        return;
+    }
+    line l;
+    put(l, "\nBaud "); put_uint(l, baud); put(l, "\r\n");
+    send_line(l, true);
+}
+
+static bool change_baud(const command &cmd) {
+    if (!cmd.digits) { // confirms a change, or just shows the rate
+        baud_pending = false;
+        show_baud(config.baud);
+        return true;
+    }
+    if (cmd.suffix || cmd.point || cmd.value > F_CPU/8 || baud_ubrr(cmd.value) == 0xFFFF)
+        return false;
+    show_baud(cmd.value); // at the old rate, so the host knows to switch
+    uart_drain();
+    set_baud(cmd.value);
+    baud_pending = cmd.value != baud_boot; // nothing to fall back to
+    baud_since = epoch_now(epoch_us_shift);
+    return true;
+}
+
+static void check_baud() {
+    if (baud_pending && epoch_now(epoch_us_shift) - baud_since > baud_confirm_us) {
+        uart_drain();
+        set_baud(baud_boot);
+        baud_pending = false;
+        show_baud(config.baud);
+    }
+}
+
+static bool run_command(const command &cmd) {
+    if (cmd.bad)
+        return false;
+    if (cmd.op == 'U') // rates don't fit in 16 bits
+        return change_baud(cmd);
+    if (cmd.op == 'K' || cmd.op == 'C') { // these take capacitances, in fF
+        if (cmd.value > value_max/cmd.unit)
+            return false;
+        uint64_t C = cmd.value*cmd.unit;
+        for (uint8_t d = cmd.decimals; d; d--)
+            C /= 10;
+        if (cmd.op == 'C')
+            set_hint(C);
+        else if (!cmd.digits)
+            cal_report();
+        else
+            cal_start(C);
+        return true;
+    }
+    
+    uint64_t v = cmd.value;
+    for (uint8_t d = cmd.decimals; d; d--)
+        v /= 10;
+    if (cmd.suffix || v > 0xFFFF)
+        return false;
+    switch (cmd.op) {
+    case 'Z':
+        for (uint8_t c = 0; c < n_sockets; c++)
+            zeros[c].force = true;
+        return true;
+    case 'R':
+        if (cmd.digits && v >= n_ranges)
+            return false;
+        config.r_lock = cmd.digits ? v : 0xFF;
+        if (cal_state == CAL_IDLE) // otherwise cal_end() applies it
+            for (uint8_t c = 0; c < n_sockets; c++)
+                chans[c].r_lock = config.r_lock;
+        return true;
+    case 'F': {
+        const uint32_t ticks = v*(F_CPU/256)/1000;
+        config.refresh_ms = v;
+        cli();
+        config.refresh_ticks = ticks;
+        sei();
+        return true;
+    }
+    case 'W':
+    case 'N':
+        bursts_flush();
+        if (cmd.op == 'W')
+            config.burst_ms = v;
+        else
+            config.burst_n = v;
+        return true;
+    case 'M':
+        if (v && (v < 3 || v > stat_max))
+            return false;
+        bursts_flush();
+        config.stat_n = v;
+        for (uint8_t c = 0; c < n_sockets; c++)
+            stat_reset(stats[c]);
+        return true;
+    case 'S':
+        config.stat_ppm = v;
+        return true;
+    case 'A':
+    case 'B':
+        bursts_flush(); // in the old format
+        config.binary = cmd.op == 'B';
+        if (config.binary)
+            send_header();
+        return true;
+    case 'V':
+        if (cmd.digits && v > 1)
+            return false;
+        config.verbose = cmd.digits ? v : !config.verbose;
+        return true;
+    case 'L':
+        if (!cmd.digits)
+            sleep_report();
+        else if (v > 1)
+            return false;
+        else
+            config.low_power = v;
+        return true;
+    case 'T':
+        range_report();
+        return true;
+    case 'H':
+        if (config.binary)
+            send_header();
+        else
+            show_settings();
+        return true;
+    #if WAVEFORM
+    case 'G':
+        if (wave_step == WAVE_IDLE)
+            wave_step = WAVE_ARMED;
+        return true;
+    #endif
+    #if PROFILE
+    case 'P':
+        prof_report();
+        return true;
+    #endif
+    }
+    return false;
+}
+
+static void poll_commands() {
+    // Gathers each command across calls as its bytes come in; see command
+    static command cmd;
+    check_baud();
+    for (int16_t b; (b = uart_read()) >= 0; ) {
+        rx_last_us = epoch_now(epoch_us_shift);
+        if (b == '\r' || b == '\n' || b == ' ' || b == ';') {
+            if (!cmd.op)
+                continue;
+            if (!run_command(cmd) && !config.binary) {
+                line l;
+                put(l, "\nBad command "); put(l, cmd.op); put(l, "\r\n");
+                send_line(l, true);
+            }
+            cmd.op = 0;
+            continue;
+        }
+        if (!cmd.op) {
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.op = b;
+            cmd.unit = 1000; // pF
+            continue;
+        }
+        const char *const units = "fpnum";
+        const char *u = b ? strchr(units, b) : 0; // strchr() would match the NUL
+        if (b >= '0' && b <= '9' && !cmd.suffix) {
+            // Too many digits would wrap to a small, valid-looking value
+            if (cmd.value > (value_max - (b - '0'))/10 || cmd.decimals == 0xFF)
+                cmd.bad = true;
+            else {
+                cmd.value = cmd.value*10 + (b - '0');
+                cmd.digits = true;
+                cmd.decimals += cmd.point;
+            }
+        }
+        else if (b == '.' && !cmd.point && !cmd.suffix)
+            cmd.point = true;
+        else if (u && cmd.digits && !cmd.suffix) {
+            cmd.suffix = true;
+            for (cmd.unit = 1; u > units; u--)
+                cmd.unit *= 1000;
+        }
+        else
+            cmd.bad = true;
+    }
+}
+
+#if SLOPE_ADC
+static void slope_correct(capture &cap) {
+    /*
+    The node falls as vs*exp(-t/RC), so the sample taken slope_delay after
+    the trip gives RC = (t + delay)/ln(1024/code), with the code taken at the
+    middle of its step. Scale the timer to what it would have read at the
+    nominal ln(5/1.1), so that everything downstream is unchanged.
+    */
+    if (!cap.adc || cap.adc >= 1023 || cap.timer == timer_overflow)
+        return;
+    const range &rg = ranges[cap.r_index];
+    const float t = cap.timer + (float)slope_delay/rg.prescale,
+                tau_trip = log(1024/(cap.adc + 0.5f));
+    cap.timer = t*taus/tau_trip + rg.delay/256.f + 0.5f; // cal_cap() takes the delay off
+}
+#endif
+
+#if WAVEFORM
+static void wave_plan(uint32_t cycles) {
+    // Spread the buffer over the expected charge, from the last one of cycles
+    const uint32_t spacing = cycles*10/(9*wave_n);
+    wave_adps = spacing >= 13*128 ? B111 : B110;
+    const uint32_t skip = spacing/(13UL << wave_adps);
+    wave_skip = skip < 1 ? 1 : skip > 0xFFFF ? 0xFFFF : skip;
+    wave_step = WAVE_READY;
+    
+    // The usual discharge leaves 10mV, which the fit would take for 0.2% of
+    // series resistance, so discharge twice as long, on the timer alone
+    #if DISCHARGE_ADC
+    if (watching == 0)
+        stop_watch();
+    #endif
+    chan_state &cs = chans[0];
+    const uint32_t now = refresh_now();
+    if ((int32_t)(cs.due - now) > 0)
+        cs.due += cs.due - now;
+}
+
+static float wave_t(uint8_t k) {
+    // Cycles from the start of the charge to sample k's hold
+    return wave_start + (13.5f + 13.f*k*wave_skip)*(1 << wave_adps);
+}
+
+static bool wave_fit(float *C, float *esr) {
+    /*
+    Through the part's series resistance r, the node starts at vs*R/(R + r)
+    and falls as exp(-t/(R + r)C), so ln(code) is a straight line in t. Fit
+    it by least squares, weighted by code^2 as a code's error in ln(code) goes
+    as 1/code, in two passes about the mean time so that floats will do. The
+    intercept gives r, and the slope then C, with the range's gain.
+    */
+    const range &rg = ranges[wave_r];
+    const float trip = wave_timer == timer_overflow ? 1e30f : (float)wave_timer*rg.prescale;
+    float sw = 0, st = 0, sy = 0;
+    uint8_t n = 0;
+    for (uint8_t k = 0; k < wave_len && wave_t(k) < trip; k++) {
+        const uint16_t code = wave_buf[k];
+        if (code < wave_fit_lo || code > wave_fit_hi)
+            continue;
+        const float w = (float)code*code;
+        sw += w;
+        st += w*wave_t(k);
+        sy += w*log(code + 0.5f);
+        n++;
+    }
+    if (n < 3)
+        return false;
+    const float tm = st/sw, ym = sy/sw;
+    float stt = 0, sty = 0;
+    for (uint8_t k = 0; k < wave_len && wave_t(k) < trip; k++) {
+        const uint16_t code = wave_buf[k];
+        if (code < wave_fit_lo || code > wave_fit_hi)
+            continue;
+        const float w = (float)code*code, dt = wave_t(k) - tm;
+        stt += w*dt*dt;
+        sty += w*dt*(log(code + 0.5f) - ym);
+    }
+    const float slope = sty/stt; // per cycle
+    if (!(slope < 0))
+        return false;
+    const float tau = -1/slope/F_CPU,
+                top = exp(ym - slope*tm); // code at t = 0
+    *esr = rg.R*(1024/top - 1);
+    *C = tau/(rg.R + *esr)*cal[0][wave_r].gain/32768;
+    return true;
+}
+
+static void wave_report() {
+    // The samples, then the fit, in bulk; waiting for room, as it's asked for
+    float C = NAN, esr = NAN;
+    const bool fit = wave_fit(&C, &esr);
+    const float dt = 13.f*wave_skip*(1 << wave_adps); // cycles between samples
+    if (config.binary) {
+        uint8_t frame[23] = {
+            sync_wave, (uint8_t)wave_seq, (uint8_t)(wave_seq >> 8),
+            0, wave_r, wave_len
+        };
+        const uint32_t t0 = wave_t(0) + 0.5f, step = dt;
+        memcpy(frame+6, &t0, 4);
+        memcpy(frame+10, &step, 4);
+        memcpy(frame+14, &C, 4);
+        memcpy(frame+18, &esr, 4);
+        send_frame(frame, sizeof(frame), true);
+        for (uint8_t i = 0; i < wave_len; i += 32) {
+            const uint8_t n = wave_len - i < 32 ? wave_len - i : 32;
+            uint8_t codes[6 + 2*32] = {
+                sync_wave_codes, (uint8_t)wave_seq, (uint8_t)(wave_seq >> 8), i, n
+            };
+            memcpy(codes+5, wave_buf+i, 2*n);
+            send_frame(codes, 6 + 2*n, true);
+        }
+    }
+    else {
+        line l;
+        put(l, "\nwave seq="); put_uint(l, wave_seq);
+        put(l, " r="); put_uint(l, wave_r);
+        put(l, " n="); put_uint(l, wave_len);
+        put(l, " t0="); put_float(l, wave_t(0)*1e6f/F_CPU, 1);
+        put(l, "us dt="); put_float(l, dt*1e6f/F_CPU, 1);
+        put(l, "us\r\n");
+        send_line(l, true);
+        for (uint8_t i = 0; i < wave_len; i += 16) {
+            line c;
+            for (uint8_t k = i; k < wave_len && k < i + 16; k++) {
+                put(c, ' '); put_uint(c, wave_buf[k]);
+            }
+            put(c, "\r\n");
+            send_line(c, true);
+        }
+        line f;
+        if (fit) {
+            put(f, "fit C="); put_si(f, to_uint(C*1e15f), si_femto); put(f, "F esr=");
+            put_float(f, esr, 1); put(f, " ohm\r\n");
+        }
+        else
+            put(f, "fit failed\r\n");
+        send_line(f, true);
+    }
+    wave_step = WAVE_IDLE;
+}
+#endif
+
+static bool ring_pop(capture *cap) {
+    uint8_t tail = ring_tail;
+    if (tail == ring_head)
+        return false;
+    *cap = ring[tail];
+    barrier();
+    ring_tail = (tail + 1) & ring_mask;
+    return true;
+}
+
+static void finish_capture(uint8_t c, uint32_t timer, uint32_t start_us, uint16_t adc) {
+    // Shared by both timers: queue the capture, and plan the socket's next charge
+    uint8_t head = ring_head, next = (head + 1) & ring_mask;
+    if (next != ring_tail) { // if full, drop; the seq gap will show it
+        const range &rg = ranges[chans[c].r_index];
+        const uint32_t counts = timer == timer_overflow ?
+                                (uint32_t)(rg.max_ovf + 1) << 16 : timer;
+        ring[head].timer = timer;
+        ring[head].stamp = start_us + counts*rg.prescale/(F_CPU/1000000);
+        ring[head].channel = c;
+        ring[head].r_index = chans[c].r_index;
+        ring[head].seq = seq;
+        ring[head].adc = adc;
+        barrier();
+        ring_head = next;
+    }
+    seq++;
+    
+    schedule_refresh(c, timer);
+    PROFILE_BEGIN(PROF_RERANGE);
+    rerange(c, timer);
+    PROFILE_END(PROF_RERANGE);
+}
+
+static void end_capture(uint32_t timer) {
+    discharge();
+    #if SLOPE_ADC
+    if (sampling) // an overflow; the trigger never came
+        stop_slope();
+    #endif
+    #if WAVEFORM
+    if (wave_step == WAVE_RUNNING)
+        stop_wave(timer);
+    #endif
+    #if SLOPE_ADC || WAVEFORM
+    const uint8_t r_prev = chans[active].r_index;
+    #endif
+    
+    finish_capture(active, timer, charge_us, slope_code);
+    slope_code = 0;
+    #if SLOPE_ADC
+    {
+        // Sample the next charge if this one was long enough and it's on the same range
+        chan_state &cs = chans[active];
+        cs.slope = timer != timer_overflow && cs.r_index == r_prev &&
+                   timer*ranges[r_prev].prescale >= slope_cycles;
+    }
+    #endif
+    #if WAVEFORM
+    // Settled on a range the ADC can read channel 0's node on
+    if (wave_step == WAVE_ARMED && active == 0 && timer != timer_overflow &&
+        chans[0].r_index == r_prev && channels[0].mux == 0xFF &&
+        !(ranges[r_prev].pin_mask & channels[0].adc_float))
+        wave_plan(timer*ranges[r_prev].prescale);
+    #endif
+    
+    charging = false;
+    start_next();
+}
+
+#if ICP5_SOCKET
+static void end_capture5(uint32_t timer) {
+    discharge5();
+    finish_capture(icp5_chan, timer, charge5_us, 0);
+    charging5 = false;
+    start_next5();
+}
+#endif
+
 void loop() {
     for (;;) { // do not allow serialEvent
-        charge();
-        while (!measured)
-            __asm__("sleep");
-        measured = false;
-        uint16_t timer = captured;
-            
-        discharge();
+        poll_commands();
+        #if WAVEFORM
+        if (wave_step == WAVE_DONE)
+            wave_report();
+        #endif
+        
+        capture cap;
+        cli();
+        if (!ring_pop(&cap)) {
+            PROFILE_BEGIN(PROF_SLEEP);
+            sleep_next();
+            PROFILE_END(PROF_SLEEP);
+            continue;
+        }
+        sei();
+        
+        #if SLOPE_ADC
+        slope_correct(cap);
+        #endif
+        if (cal_state != CAL_IDLE)
+            cal_add(cap);
+        PROFILE_BEGIN(PROF_OUTPUT);
+        if (config.stat_n)
+            stat_add(cap);
+        else if (config.burst_ms || config.burst_n)
+            burst_add(cap);
+        else
+            output_cap(cap);
+        PROFILE_END(PROF_OUTPUT);
+    }
+}
+
+ISR(USART0_UDRE_vect) { // room in the data register for the next byte
+    uint8_t tail = tx_tail;
+    UDR0 = tx_buf[tail++];
+    tx_tail = tail;
+    if (tail == tx_head) {
+        UCSR0B &= ~(1 << UDRIE0); // drained; uart_send() restarts it
+        UCSR0A = (1 << TXC0) | (1 << U2X0); // "clear", so TXC0 means the last byte is out
+        tx_used = true;
+    }
+}
 
-        print_cap(timer);
-        rerange(timer);
-        while (!refresh_ready)
-            __asm__("sleep");
-        refresh_ready = false;
+ISR(USART0_RX_vect) {
+    const uint8_t b = UDR0, head = rx_head, next = (head + 1) & rx_mask;
+    if (next != rx_tail) { // if full, drop
+        rx_buf[head] = b;
+        barrier();
+        rx_head = next;
     }
 }
 
-ISR(TIMER3_COMPA_vect) { // refresh every 0.5s
-    refresh_ready = true;
+ISR(TIMER3_COMPA_vect) { // a channel may have had enough time to discharge
+    if (!charging)
+        start_next(true);
+}
+
+ISR(WDT_vect) { // calibrated, or woken from deep sleep
+    wdt_stop();
+    if (!wdt_cal_ticks) {
+        wdt_cal_ticks = refresh_now() - wdt_cal_start;
+        return;
+    }
+    if (!deep)
+        return;
+    // Timer 3 has been running for whatever of the period came after an early wake
+    uint32_t ticks = deep_ticks;
+    if (deep_early) {
+        const uint32_t awake = refresh_now() - deep_woke;
+        ticks = ticks > awake ? ticks - awake : 0;
+    }
+    clocks_forward(ticks);
+    sleep_stats[deep].ticks += ticks;
+    deep = SLEEP_IDLE;
+    if (!charging)
+        start_next(true); // the alarm may have been stepped over
+    #if ICP5_SOCKET
+    if (!charging5)
+        start_next5();
+    #endif
+}
+
+ISR(PCINT1_vect) { } // RXD0 changed; just wake
+
+ISR(TIMER3_OVF_vect) {
+    refresh_high++;
+}
+
+ISR(ADC_vect) { // discharge watch, slope sample or waveform conversion done
+    #if WAVEFORM
+    if (wave_step == WAVE_RUNNING) {
+        if (wave_len < wave_n && !--wave_div) {
+            wave_buf[wave_len++] = ADC;
+            wave_div = wave_skip;
+            if (wave_len == wave_n)
+                ADCSRA &= ~(1 << ADATE); // full; let the one under way finish
+        }
+        return;
+    }
+    #endif
+    #if SLOPE_ADC
+    if (sampling) {
+        if (!sampled_timer) // the warm-up conversion
+            return;
+        slope_code = ADC;
+        stop_slope();
+        end_capture(sampled_timer);
+        return;
+    }
+    #endif
+    #if DISCHARGE_ADC
+    // The same residual the refresh schedule assumes, rounded in, so 1022 (9.8mV)
+    static const uint16_t adc_discharged = 1024 - (uint16_t)(1024/5.f*v_discharged);
+    if (ADC >= adc_discharged) {
+        const uint8_t c = watching;
+        chan_state &cs = chans[c];
+        const uint32_t now = refresh_now();
+        cs.due = (int32_t)(cs.held - now) > 0 ? cs.held : now;
+        stop_watch();
+        #if ICP5_SOCKET
+        if (c == icp5_chan) {
+            if (!charging5)
+                start_next5();
+            return;
+        }
+        #endif
+        if (!charging)
+            start_next();
+    }
+    else
+        ADCSRA |= 1 << ADSC; // again
+    #endif
 }
 
 ISR(TIMER1_CAPT_vect) { // comparator capture (ok charge time)
-    captured = ICR1;
-    measured = true;
+    PROFILE_BEGIN(PROF_CAPTURE);
+    uint16_t icr = ICR1;
+    uint8_t ovf = overflows;
+    // An overflow still pending means the counter wrapped just before the
+    // capture, unless ICR is from the very end of the previous period
+    if ((TIFR1 & (1 << TOV1)) && icr < 0x8000) {
+        // That may be the overflow that ends the range, as in TIMER1_OVF_vect
+        if (ovf == ranges[chans[active].r_index].max_ovf) {
+            end_capture(timer_overflow);
+            PROFILE_END(PROF_CAPTURE);
+            return;
+        }
+        ovf++;
+    }
+    #if SLOPE_ADC
+    if (sampling) { // the ADC ISR finishes the capture once it has the node
+        sampled_timer = (uint32_t)ovf << 16 | icr;
+        TCCR1B = 0; // Stop clock, so no overflow can end it first
+        PROFILE_END(PROF_CAPTURE);
+        return;
+    }
+    #endif
+    end_capture((uint32_t)ovf << 16 | icr);
+    PROFILE_END(PROF_CAPTURE);
 }
 
-ISR(TIMER1_OVF_vect) { // timer overflow (took too long to charge) 
-    captured = 0xFFFF;
-    measured = true;
+ISR(TIMER1_OVF_vect) { // count another 2^16, or give up (took too long to charge)
+    if (overflows == ranges[chans[active].r_index].max_ovf)
+        end_capture(timer_overflow);
+    else
+        overflows++;
 }
 
+#if ICP5_SOCKET
+ISR(TIMER5_CAPT_vect) { // external comparator capture
+    uint16_t icr = ICR5;
+    uint8_t ovf = overflows5;
+    if ((TIFR5 & (1 << TOV5)) && icr < 0x8000) {
+        if (ovf == ranges[chans[icp5_chan].r_index].max_ovf) {
+            end_capture5(timer_overflow);
+            return;
+        }
+        ovf++;
+    }
+    end_capture5((uint32_t)ovf << 16 | icr);
+}
+
+ISR(TIMER5_OVF_vect) {
+    if (overflows5 == ranges[chans[icp5_chan].r_index].max_ovf)
+        end_capture5(timer_overflow);
+    else
+        overflows5++;
+}
 
+ISR(TIMER3_COMPB_vect) { // the ICP5 socket may have had enough time to discharge
+    if (!charging5)
+        start_next5();
+}
+#endif
+
+ISR(TIMER4_OVF_vect) {
+    epoch_high++;
+}
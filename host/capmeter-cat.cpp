@@ -0,0 +1,114 @@
+/*
+Print the readings from one or more meters in binary mode, a line each, using
+the host library. A device of - reads stdin, such as the simulator's output:
+    g++ -std=gnu++11 -O2 -Wall -Ihost host/capmeter.cpp host/capmeter-cat.cpp -o capmeter-cat
+    ./capmeter-cat -B /dev/ttyACM0 /dev/ttyACM1
+    ./capmeter-sim -DOUTPUT_BINARY=1 -c 1e-9 | ./capmeter-cat -
+(for the second, build the simulator with -DOUTPUT_BINARY=1). Each line is the
+meter's index on the command line, the timestamp in us, the channel and range,
+and the reading in farads; bursts and statistics add their count and standard
+deviation in farads, and waveforms their fit.
+*/
+
+#include "capmeter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+class printer: public capmeter::handler {
+public:
+    explicit printer(unsigned index): index(index) { }
+
+    void on_sample(const capmeter::meter &m, const capmeter::sample &s) {
+        if (s.overflow())
+            printf("%u %10u c%u r%u over\n", index, s.stamp, s.channel, s.r_index);
+        else
+            printf("%u %10u c%u r%u %.4e\n", index, s.stamp, s.channel, s.r_index,
+                   m.farads(s.channel, s.r_index, s.timer));
+    }
+    void on_burst(const capmeter::meter &m, const capmeter::burst &b) {
+        print(m, b.stamp, b.channel, b.r_index, b.mean, b.count, b.var);
+    }
+    void on_stats(const capmeter::meter &m, const capmeter::stats &s) {
+        print(m, s.stamp, s.channel, s.r_index, s.mean, s.count, s.var);
+    }
+    void on_wave(const capmeter::meter &, const capmeter::wave &w) {
+        printf("%u wave seq=%u c%u r%u n=%u C=%.4e esr=%.2f\n", index, w.seq,
+               w.channel, w.r_index, w.n, w.C, w.esr);
+    }
+
+private:
+    unsigned index;
+
+    void print(const capmeter::meter &m, uint32_t stamp, uint8_t c, uint8_t r,
+               double mean, unsigned n, float var) {
+        // The spread scales like the reading, less the offset
+        const double C = m.farads(c, r, mean),
+                     per = m.farads(c, r, mean + 1) - C;
+        printf("%u %10u c%u r%u %.4e n=%u s=%.2e\n", index, stamp, c, r, C, n,
+               sqrt(var)*per);
+    }
+};
+
+void usage() {
+    fputs("usage: capmeter-cat [-b baud] [-B] device...\n"
+          "  -b  serial speed; default 115200\n"
+          "  -B  send B; to switch each meter to binary\n"
+          "  a device of - reads stdin\n", stderr);
+    exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    uint32_t baud = 115200;
+    bool to_binary = false;
+    for (int opt; (opt = getopt(argc, argv, "b:B")) != -1; ) {
+        switch (opt) {
+        case 'b': baud = strtoul(optarg, 0, 10); break;
+        case 'B': to_binary = true; break;
+        default: usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    std::vector<printer*> printers;
+    std::vector<capmeter::reader*> readers;
+    for (int i = optind; i < argc; i++) {
+        printer *p = new printer(i - optind);
+        capmeter::reader *r = new capmeter::reader(*p);
+        const bool is_stdin = argv[i][0] == '-' && !argv[i][1];
+        if (is_stdin)
+            r->attach(0);
+        else if (!r->open(argv[i], baud)) {
+            perror(argv[i]);
+            return 1;
+        }
+        if (to_binary && !is_stdin && !r->send("B;")) {
+            perror(argv[i]);
+            return 1;
+        }
+        printers.push_back(p);
+        readers.push_back(r);
+    }
+    setvbuf(stdout, 0, _IOLBF, 0);
+    if (!capmeter::run(&readers[0], readers.size())) {
+        perror("poll");
+        return 1;
+    }
+
+    for (size_t i = 0; i < readers.size(); i++) {
+        const capmeter::counters &c = readers[i]->parse().count();
+        fprintf(stderr, "%u: %u frames, %u CRC errors, %u bytes skipped, %u lost\n",
+                (unsigned)i, c.frames, c.crc_errors, c.skipped, c.lost);
+        delete readers[i];
+        delete printers[i];
+    }
+    return 0;
+}
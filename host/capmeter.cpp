@@ -0,0 +1,376 @@
+#include "capmeter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+namespace capmeter {
+
+// Frame sizes, sync byte and CRC included
+static const size_t sample_len = 14,
+                    burst_len = 20,
+                    stats_len = 23,
+                    wave_len = 23,
+                    wave_codes_max = 32,
+                    header_min = 9,
+                    header_max = 9 + 8*max_ranges + 6*max_channels*max_ranges;
+static_assert(header_max <= parser::buf_size, "a header must fit in the buffer");
+
+static uint8_t crc8(const uint8_t *p, size_t n) {
+    // CRC-8 CCITT, poly 0x07, as avr-libc's _crc8_ccitt_update()
+    uint8_t crc = 0;
+    while (n--) {
+        crc ^= *p++;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+// Little-endian fields; the frames are packed, so never cast into them
+static uint16_t le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static float lef(const uint8_t *p) {
+    const uint32_t u = le32(p);
+    float f;
+    memcpy(&f, &u, 4);
+    return f;
+}
+
+double meter::farads(uint8_t channel, uint8_t r_index, double timer) const {
+    // C = (timer - delay - offset)*gain*prescale/F_CPU/ln(5/1.1)/R, as cal_cap()
+    if (!valid || channel >= channels || r_index >= n_ranges)
+        return NAN;
+    const range &rg = ranges[r_index];
+    const cal_entry &k = cal[channel][r_index];
+    const double t = timer - (rg.delay + (double)k.offset)/256;
+    if (t <= 0)
+        return 0;
+    return t*k.gain/32768*rg.prescale/f_cpu/log(5/1.1)/rg.R;
+}
+
+parser::parser(handler &h): h(h), m(), c(), seq_valid(false), seq_next(0), held(0) { }
+
+size_t parser::frame_len(const uint8_t *p, size_t n) const {
+    // Length of the frame starting at p; 0 if it can't be one, or n+1 if more
+    // bytes are needed to tell
+    switch (p[0]) {
+    case sync_sample: return sample_len;
+    case sync_burst: return burst_len;
+    case sync_stats: return stats_len;
+    case sync_wave: return wave_len;
+    case sync_wave_codes:
+        if (n < 5)
+            return n+1;
+        return p[4] && p[4] <= wave_codes_max ? 6 + 2*p[4] : 0;
+    case sync_header: {
+        if (n < 8)
+            return n+1;
+        const uint8_t channels = p[6], n_ranges = p[7];
+        if (p[1] != proto_version || !channels || channels > max_channels ||
+            !n_ranges || n_ranges > max_ranges)
+            return 0;
+        return header_min + 8*n_ranges + 6*channels*n_ranges;
+    }
+    default: return 0;
+    }
+}
+
+size_t parser::scan(const uint8_t *p, size_t n) {
+    // Dispatch every whole frame in p; returns how many bytes were used, the
+    // rest being the start of a frame still to come
+    size_t i = 0;
+    while (i < n) {
+        const size_t len = frame_len(p+i, n-i);
+        if (!len) {
+            c.skipped++;
+            i++;
+            continue;
+        }
+        if (len > n-i)
+            break;
+        if (crc8(p+i+1, len-2) != p[i+len-1]) {
+            // Most likely a sync value in text or a damaged frame; the real
+            // start is somewhere after it
+            c.crc_errors++;
+            c.skipped++;
+            i++;
+            continue;
+        }
+        dispatch(p+i);
+        i += len;
+    }
+    return i;
+}
+
+void parser::dispatch(const uint8_t *p) {
+    c.frames++;
+    switch (p[0]) {
+    case sync_header: {
+        m.f_cpu = le32(p+2);
+        m.channels = p[6];
+        m.n_ranges = p[7];
+        const uint8_t *f = p+8;
+        for (uint8_t r = 0; r < m.n_ranges; r++, f += 8) {
+            m.ranges[r].R = le32(f);
+            m.ranges[r].prescale = le16(f+4);
+            m.ranges[r].delay = le16(f+6);
+        }
+        for (uint8_t ch = 0; ch < m.channels; ch++)
+            for (uint8_t r = 0; r < m.n_ranges; r++, f += 6) {
+                m.cal[ch][r].offset = (int32_t)le32(f);
+                m.cal[ch][r].gain = le16(f+4);
+            }
+        m.valid = true;
+        h.on_header(m);
+        break;
+    }
+    case sync_sample: {
+        sample s;
+        s.seq = le16(p+1);
+        s.channel = p[3];
+        s.r_index = p[4];
+        s.timer = le32(p+5);
+        s.stamp = le32(p+9);
+        // Captures in a burst or window don't get their own frames, so only
+        // count gaps between consecutive per-capture frames
+        if (seq_valid)
+            c.lost += (uint16_t)(s.seq - seq_next);
+        seq_valid = true;
+        seq_next = s.seq + 1;
+        h.on_sample(m, s);
+        break;
+    }
+    case sync_burst: {
+        burst b;
+        b.seq = le16(p+1);
+        b.channel = p[3];
+        b.r_index = p[4];
+        b.count = le16(p+5);
+        b.mean = le32(p+7)/256.;
+        b.var = lef(p+11);
+        b.stamp = le32(p+15);
+        seq_valid = false;
+        h.on_burst(m, b);
+        break;
+    }
+    case sync_stats: {
+        stats s;
+        s.seq = le16(p+1);
+        s.channel = p[3];
+        s.r_index = p[4];
+        s.count = p[5];
+        s.median = le32(p+6)/256.;
+        s.mean = le32(p+10)/256.;
+        s.var = lef(p+14);
+        s.stamp = le32(p+18);
+        seq_valid = false;
+        h.on_stats(m, s);
+        break;
+    }
+    case sync_wave: {
+        wave w;
+        w.seq = le16(p+1);
+        w.channel = p[3];
+        w.r_index = p[4];
+        w.n = p[5];
+        w.t0 = le32(p+6);
+        w.dt = le32(p+10);
+        w.C = lef(p+14);
+        w.esr = lef(p+18);
+        h.on_wave(m, w);
+        break;
+    }
+    case sync_wave_codes: {
+        wave_codes w;
+        w.seq = le16(p+1);
+        w.first = p[3];
+        w.count = p[4];
+        w.raw = p+5;
+        h.on_wave_codes(m, w);
+        break;
+    }
+    }
+}
+
+void parser::keep(const uint8_t *p, size_t n) {
+    // Hold on to an unfinished frame, at the start of buf
+    memmove(buf, p, n);
+    held = n;
+}
+
+void parser::commit(size_t n) {
+    c.bytes += n;
+    const size_t all = held + n, used = scan(buf, all);
+    keep(buf + used, all - used);
+}
+
+void parser::feed(const uint8_t *p, size_t n) {
+    // Finish any frame held from last time by topping it up with only the
+    // bytes it still needs, or one at a time until its length is known; from
+    // then on, parse in place
+    c.bytes += n;
+    while (held && n) {
+        const size_t need = frame_len(buf, held) - held,
+                     take = n < need ? n : need;
+        memcpy(buf + held, p, take);
+        p += take;
+        n -= take;
+        const size_t all = held + take, used = scan(buf, all);
+        keep(buf + used, all - used);
+    }
+    const size_t used = scan(p, n);
+    if (used < n)
+        keep(p + used, n - used);
+}
+
+static bool speed_of(uint32_t baud, speed_t &s) {
+    switch (baud) {
+    case 9600: s = B9600; return true;
+    case 19200: s = B19200; return true;
+    case 38400: s = B38400; return true;
+    case 57600: s = B57600; return true;
+    case 115200: s = B115200; return true;
+    case 230400: s = B230400; return true;
+#ifdef B500000
+    case 500000: s = B500000; return true;
+#endif
+#ifdef B1000000
+    case 1000000: s = B1000000; return true;
+#endif
+#ifdef B2000000
+    case 2000000: s = B2000000; return true;
+#endif
+    default: return false; // 250k and the like need a custom divisor
+    }
+}
+
+reader::~reader() {
+    close();
+}
+
+bool reader::open(const char *path, uint32_t baud) {
+    close();
+    const int fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    termios t;
+    if (tcgetattr(fd, &t)) {
+        ::close(fd);
+        return false;
+    }
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &t)) {
+        ::close(fd);
+        return false;
+    }
+    fd_ = fd;
+    owned = true;
+    p.restart();
+    if (!set_baud(baud)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void reader::attach(int fd) {
+    close();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fd_ = fd;
+    owned = false;
+    p.restart();
+}
+
+void reader::close() {
+    if (owned && fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+    owned = false;
+}
+
+bool reader::set_baud(uint32_t baud) {
+    // Wait for anything going out at the old rate, such as the U command
+    speed_t s;
+    termios t;
+    if (!speed_of(baud, s) || tcdrain(fd_) || tcgetattr(fd_, &t))
+        return false;
+    cfsetispeed(&t, s);
+    cfsetospeed(&t, s);
+    return !tcsetattr(fd_, TCSANOW, &t);
+}
+
+bool reader::send(const char *cmd) {
+    // The meter reads a byte at a time, so short writes just go again
+    size_t n = strlen(cmd);
+    while (n) {
+        const ssize_t w = write(fd_, cmd, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return false;
+            pollfd q = {fd_, POLLOUT, 0};
+            if (poll(&q, 1, -1) < 0 && errno != EINTR)
+                return false;
+            continue;
+        }
+        cmd += w;
+        n -= w;
+    }
+    return true;
+}
+
+bool reader::read() {
+    // Straight into the parser's buffer, until there's nothing left to read
+    for (;;) {
+        const ssize_t n = ::read(fd_, p.space(), p.room());
+        if (n > 0) {
+            p.commit(n);
+            continue;
+        }
+        if (n == 0)
+            return false;
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+}
+
+bool run(reader *const *readers, size_t n, int timeout_ms) {
+    std::vector<pollfd> q(n);
+    for (size_t i = 0; i < n; i++) {
+        q[i].fd = readers[i]->fd();
+        q[i].events = POLLIN;
+    }
+    for (size_t open = n; open; ) {
+        const int k = poll(q.data(), n, timeout_ms);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (!k)
+            return true;
+        for (size_t i = 0; i < n; i++) {
+            if (q[i].fd < 0 || !q[i].revents)
+                continue;
+            if (!readers[i]->read() || (q[i].revents & (POLLERR | POLLNVAL)) ||
+                ((q[i].revents & POLLHUP) && !(q[i].revents & POLLIN))) {
+                q[i].fd = -1; // poll() skips it from now on
+                open--;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace capmeter
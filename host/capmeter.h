@@ -0,0 +1,182 @@
+/*
+Host library for the capmeter's binary output (`B`, or OUTPUT_BINARY; see the
+readme for the frame layouts). It parses the frames in place, in the buffer the
+serial port was read into, and hands each to a handler along with the range
+table and calibration from the meter's last header, so it can be turned into
+farads. Nothing is allocated per frame, and a parser holds one meter's state,
+so one process can service as many meters as it has file descriptors.
+
+Build it in with the application, e.g. from the repository root:
+    g++ -std=gnu++11 -O2 -Wall -Ihost host/capmeter.cpp app.cpp -o app
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace capmeter {
+
+static const uint8_t proto_version = 8,
+                     max_channels = 8,
+                     max_ranges = 16;
+
+static const uint8_t sync_header = 0x5A,
+                     sync_sample = 0xA5,
+                     sync_burst = 0xA6,
+                     sync_stats = 0xA7,
+                     sync_wave = 0xA8,
+                     sync_wave_codes = 0xA9;
+
+static const uint32_t timer_overflow = 0xFFFFFFFF;
+
+// The meter's header: its range table and calibration
+struct range {
+    uint32_t R;        // ohms
+    uint16_t prescale; // Timer 1 prescaler
+    uint16_t delay;    // capture delay, Q8 timer counts
+};
+struct cal_entry {
+    int32_t offset;    // Q8 timer counts
+    uint16_t gain;     // Q15
+};
+struct meter {
+    bool valid;        // false until the first header
+    uint32_t f_cpu;
+    uint8_t channels, n_ranges;
+    range ranges[max_ranges];
+    cal_entry cal[max_channels][max_ranges];
+
+    // Farads from a timer reading in counts, as the meter reports it; NaN
+    // before a header or for a channel or range it doesn't have
+    double farads(uint8_t channel, uint8_t r_index, double timer) const;
+};
+
+// One frame of each kind; timers are in counts, and stamps in us from boot
+struct sample {
+    uint16_t seq;
+    uint8_t channel, r_index;
+    uint32_t timer;    // timer_overflow if the charge didn't finish
+    uint32_t stamp;
+    bool overflow() const { return timer == timer_overflow; }
+};
+struct burst {
+    uint16_t seq;      // of the last capture
+    uint8_t channel, r_index;
+    uint16_t count;
+    double mean;
+    float var;         // counts^2
+    uint32_t stamp;
+};
+struct stats {
+    uint16_t seq;      // of the last capture
+    uint8_t channel, r_index;
+    uint8_t count;
+    double median, mean; // mean of the middle half
+    float var;         // of the middle half, counts^2
+    uint32_t stamp;
+};
+
+// A waveform (`G`, in WAVEFORM builds): its fit, then its codes in chunks
+struct wave {
+    uint16_t seq;      // of the capture it was recorded on
+    uint8_t channel, r_index;
+    uint8_t n;         // samples to follow
+    uint32_t t0, dt;   // CPU cycles from the charge starting to sample 0, and between samples
+    float C, esr;      // the meter's fit in farads and ohms; NaN if it failed
+};
+struct wave_codes {
+    uint16_t seq;
+    uint8_t first, count;
+    const uint8_t *raw; // in the parser's buffer, valid during the callback
+    uint16_t code(uint8_t i) const { return raw[2*i] | raw[2*i+1] << 8; } // /1024 of AVCC
+};
+
+// Called from parser::commit() and feed(); the default for each is to ignore it
+class handler {
+public:
+    virtual ~handler() { }
+    virtual void on_header(const meter &) { }
+    virtual void on_sample(const meter &, const sample &) { }
+    virtual void on_burst(const meter &, const burst &) { }
+    virtual void on_stats(const meter &, const stats &) { }
+    virtual void on_wave(const meter &, const wave &) { }
+    virtual void on_wave_codes(const meter &, const wave_codes &) { }
+};
+
+struct counters {
+    uint64_t bytes;      // read in all
+    uint32_t frames;     // good frames
+    uint32_t crc_errors; // frames dropped for a bad CRC
+    uint32_t skipped;    // bytes outside a frame, such as text
+    uint32_t lost;       // per-capture frames missing from the sequence
+};
+
+/*
+Either read into space() and commit() what was read, which copies nothing but
+a frame split across reads, or feed() from a buffer of your own, which parses
+it in place and copies only a frame left unfinished at its end.
+*/
+class parser {
+public:
+    static const size_t buf_size = 4096;
+
+    explicit parser(handler &h);
+
+    uint8_t *space() { return buf + held; }
+    size_t room() const { return buf_size - held; }
+    void commit(size_t n);
+    void feed(const uint8_t *p, size_t n);
+    // For a new stream, such as the port reopened: drops any frame held from
+    // the old one and restarts the sequence; counters and the header stay
+    void restart() { held = 0; seq_valid = false; }
+
+    const meter &info() const { return m; }
+    const counters &count() const { return c; }
+
+private:
+    handler &h;
+    meter m;
+    counters c;
+    bool seq_valid;
+    uint16_t seq_next;   // expected from the next per-capture frame
+    uint8_t buf[buf_size];
+    size_t held;         // bytes of an unfinished frame at the start of buf
+
+    size_t frame_len(const uint8_t *p, size_t n) const;
+    size_t scan(const uint8_t *p, size_t n);
+    void dispatch(const uint8_t *p);
+    void keep(const uint8_t *p, size_t n);
+};
+
+/*
+A meter on a serial port, or any file descriptor, read without blocking.
+Call read() when the descriptor is readable, from poll() or an event loop, or
+hand a set of them to run().
+*/
+class reader {
+public:
+    explicit reader(handler &h): p(h), fd_(-1), owned(false) { }
+    ~reader();
+
+    bool open(const char *path, uint32_t baud = 115200); // the tty, raw
+    void attach(int fd);            // an fd that's already open; not closed
+                                    // (both restart the parser)
+    void close();
+    bool set_baud(uint32_t baud);   // on the host side only; see the `U` command
+    bool send(const char *cmd);     // commands, e.g. "B;"
+
+    bool read();                    // false at EOF or on an error
+    int fd() const { return fd_; }
+    const parser &parse() const { return p; }
+
+private:
+    parser p;
+    int fd_;
+    bool owned;
+};
+
+// Read all of the readers until each hits EOF or an error, or until timeout_ms
+// passes with nothing to read (-1 for no timeout); false on a poll() error
+bool run(reader *const *readers, size_t n, int timeout_ms = -1);
+
+} // namespace capmeter
@@ -0,0 +1,416 @@
+/*
+Reads any number of meters in binary mode from one epoll loop and publishes
+their readings, merged, to a shared-memory ring (see capmeterd.h), with a
+table of per-board counters. A board that goes away is reopened once a second.
+
+    g++ -std=gnu++11 -O2 -Wall -Ihost host/capmeter.cpp host/capmeterd.cpp -o capmeterd -lrt
+    ./capmeterd -B -c rack.cal /dev/ttyACM*
+    ./capmeterd -w                # follow the ring and print it
+
+The calibration file has a line per board, "device zero gain": the reading in
+farads to take off, after the meter's own calibration, and the factor to
+multiply what's left by, for the fixture each board sits in. Boards not in it
+get 0 and 1. Readings are converted and calibrated a batch at a time, one
+batch per read of the port, and each batch goes into the ring with one update
+of its head.
+*/
+
+#include "capmeter.h"
+#include "capmeterd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+using capmeterd::record;
+
+static volatile sig_atomic_t stopping = 0;
+static void on_signal(int) { stopping = 1; }
+
+static uint64_t now_ns(clockid_t clock = CLOCK_REALTIME) {
+    timespec t;
+    clock_gettime(clock, &t);
+    return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+class board: public capmeter::handler {
+public:
+    static const size_t batch_max = 512; // more than a full read's worth
+
+    board(uint16_t index, const std::string &path):
+        index(index), path(path), zero(0), gain(1), r(*this), n(0), opened(false),
+        reopens(0), readings(0), last_bytes(0), last_readings(0) { }
+
+    uint16_t index;
+    std::string path;
+    double zero, gain;  // from the calibration file
+    capmeter::reader r;
+    record batch[batch_max];
+    size_t n;
+    bool opened;        // up at some point, so opening it again is a reopen
+    uint32_t reopens;
+    uint64_t readings, last_bytes, last_readings;
+
+    void on_sample(const capmeter::meter &m, const capmeter::sample &s) {
+        record &rec = add(s.stamp, s.channel, s.r_index, 1);
+        if (s.overflow()) {
+            rec.kind = capmeterd::KIND_OVERFLOW;
+            rec.farads = INFINITY;
+        }
+        else {
+            rec.kind = capmeterd::KIND_SAMPLE;
+            rec.farads = m.farads(s.channel, s.r_index, s.timer);
+        }
+    }
+    void on_burst(const capmeter::meter &m, const capmeter::burst &b) {
+        record &rec = add(b.stamp, b.channel, b.r_index, b.count);
+        rec.kind = capmeterd::KIND_BURST;
+        spread(m, rec, b.mean, b.var);
+    }
+    void on_stats(const capmeter::meter &m, const capmeter::stats &s) {
+        record &rec = add(s.stamp, s.channel, s.r_index, s.count);
+        rec.kind = capmeterd::KIND_STATS;
+        spread(m, rec, s.mean, s.var);
+    }
+
+private:
+    record &add(uint32_t stamp, uint8_t channel, uint8_t r_index, uint16_t count);
+    void spread(const capmeter::meter &m, record &rec, double mean, float var) {
+        rec.farads = m.farads(rec.channel, rec.r_index, mean);
+        rec.sd = sqrt(var)*(m.farads(rec.channel, rec.r_index, mean + 1) - rec.farads);
+    }
+};
+
+class publisher {
+public:
+    publisher(): ring(0), mask(0) { }
+
+    bool map(const char *name, uint32_t capacity);
+    void publish(board &b);
+    void tick(const std::vector<board*> &boards, double dt);
+    void flush_all(const std::vector<board*> &boards) {
+        for (size_t i = 0; i < boards.size(); i++)
+            publish(*boards[i]);
+    }
+
+private:
+    capmeterd::ring *ring;
+    uint32_t mask;
+};
+
+// Set once the ring is mapped, so that a full batch can go out early
+static publisher *out;
+
+record &board::add(uint32_t stamp, uint8_t channel, uint8_t r_index, uint16_t count) {
+    if (n == batch_max)
+        out->publish(*this);
+    record &rec = batch[n++];
+    rec.stamp = stamp;
+    rec.board = index;
+    rec.n = count;
+    rec.channel = channel;
+    rec.r_index = r_index;
+    rec.sd = 0;
+    rec.pad = 0;
+    readings++;
+    return rec;
+}
+
+bool publisher::map(const char *name, uint32_t capacity) {
+    const int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    const size_t size = capmeterd::ring_size(capacity);
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return false;
+    }
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    ring = (capmeterd::ring*)p;
+    // Readers check the magic last, so they see a whole header or none
+    ring->magic = 0;
+    ring->version = capmeterd::shm_version;
+    ring->capacity = capacity;
+    ring->n_boards = 0;
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->magic, capmeterd::shm_magic, __ATOMIC_RELEASE);
+    mask = capacity - 1;
+    return true;
+}
+
+void publisher::publish(board &b) {
+    // The board's calibration for the whole batch, then one head update
+    const uint64_t t = now_ns();
+    uint64_t head = ring->head;
+    for (size_t i = 0; i < b.n; i++) {
+        record &rec = b.batch[i];
+        rec.host_ns = t;
+        if (rec.kind != capmeterd::KIND_OVERFLOW) {
+            rec.farads = (rec.farads - b.zero)*b.gain;
+            rec.sd *= b.gain;
+        }
+        // Odd while the record is torn, so a reader copying it can tell
+        capmeterd::slot &sl = ring->records[head & mask];
+        __atomic_store_n(&sl.seq, 2*head + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        sl.rec = rec;
+        __atomic_store_n(&sl.seq, 2*head + 2, __ATOMIC_RELEASE);
+        head++;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    b.n = 0;
+}
+
+void publisher::tick(const std::vector<board*> &boards, double dt) {
+    ring->n_boards = boards.size();
+    for (size_t i = 0; i < boards.size(); i++) {
+        board &b = *boards[i];
+        capmeterd::board &s = ring->boards[i];
+        const capmeter::counters &c = b.r.parse().count();
+        strncpy(s.path, b.path.c_str(), sizeof(s.path) - 1);
+        s.up = b.r.fd() >= 0;
+        s.reopens = b.reopens;
+        s.bytes = c.bytes;
+        s.frames = c.frames;
+        s.readings = b.readings;
+        s.crc_errors = c.crc_errors;
+        s.skipped = c.skipped;
+        s.lost = c.lost;
+        s.bytes_per_s = (c.bytes - b.last_bytes)/dt;
+        s.readings_per_s = (b.readings - b.last_readings)/dt;
+        b.last_bytes = c.bytes;
+        b.last_readings = b.readings;
+    }
+}
+
+bool load_cal(const char *file, std::vector<board*> &boards) {
+    FILE *f = fopen(file, "r");
+    if (!f)
+        return false;
+    char line[256], dev[200];
+    double zero, gain;
+    for (unsigned l = 1; fgets(line, sizeof(line), f); l++) {
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+            continue;
+        if (sscanf(line, "%199s %lf %lf", dev, &zero, &gain) != 3) {
+            fprintf(stderr, "%s:%u: expected \"device zero gain\"\n", file, l);
+            continue;
+        }
+        for (size_t i = 0; i < boards.size(); i++)
+            if (boards[i]->path == dev) {
+                boards[i]->zero = zero;
+                boards[i]->gain = gain;
+            }
+    }
+    fclose(f);
+    return true;
+}
+
+bool open_board(board &b, int ep, uint32_t baud, bool to_binary) {
+    if (b.path == "-")
+        b.r.attach(0);
+    else if (!b.r.open(b.path.c_str(), baud) || (to_binary && !b.r.send("B;"))) {
+        b.r.close();
+        return false;
+    }
+    epoll_event e;
+    e.events = EPOLLIN;
+    e.data.u32 = b.index;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, b.r.fd(), &e)) {
+        b.r.close();
+        return false;
+    }
+    if (b.opened)
+        b.reopens++;
+    b.opened = true;
+    return true;
+}
+
+int watch(const char *name) {
+    // Follow the ring from its current head and print each record
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(name);
+        return 1;
+    }
+    capmeterd::ring *head = (capmeterd::ring*)mmap(0, sizeof(capmeterd::ring),
+                                                   PROT_READ, MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED || __atomic_load_n(&head->magic, __ATOMIC_ACQUIRE) != capmeterd::shm_magic ||
+        head->version != capmeterd::shm_version) {
+        fprintf(stderr, "%s: not a capmeterd ring\n", name);
+        return 1;
+    }
+    const uint32_t capacity = head->capacity, mask = capacity - 1;
+    const capmeterd::ring *ring = (const capmeterd::ring*)mmap(
+        0, capmeterd::ring_size(capacity), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror(name);
+        return 1;
+    }
+    setvbuf(stdout, 0, _IOLBF, 0);
+    uint64_t tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), lapped = 0;
+    while (!stopping) {
+        const uint64_t h = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (h < tail)
+            tail = 0; // the daemon started over
+        if (h - tail > capacity) {
+            lapped += h - capacity - tail;
+            tail = h - capacity;
+        }
+        for (; tail != h; tail++) {
+            // A seqlock: the slot must hold this record, before and after the copy
+            const capmeterd::slot &sl = ring->records[tail & mask];
+            const uint64_t seq = __atomic_load_n(&sl.seq, __ATOMIC_ACQUIRE);
+            const record rec = sl.rec;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (seq != 2*tail + 2 || __atomic_load_n(&sl.seq, __ATOMIC_RELAXED) != seq)
+                break; // overwritten as it was copied; catch up next time
+            printf("%s %10u c%u r%u %.4e", ring->boards[rec.board].path, rec.stamp,
+                   rec.channel, rec.r_index, rec.farads);
+            if (rec.kind >= capmeterd::KIND_BURST)
+                printf(" n=%u s=%.2e", rec.n, rec.sd);
+            putchar('\n');
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "%llu records lost to the writer\n", (unsigned long long)lapped);
+    return 0;
+}
+
+void usage() {
+    fputs("usage: capmeterd [-b baud] [-B] [-c calfile] [-n records] [-s name] device...\n"
+          "       capmeterd -w [-s name]\n"
+          "  -b  serial speed; default 115200\n"
+          "  -B  send B; to switch each meter to binary when it's opened\n"
+          "  -c  per-board calibration, lines of \"device zero_farads gain\"\n"
+          "  -n  ring size in records, rounded up to a power of 2; default 65536\n"
+          "  -s  shared memory name; default /capmeter\n"
+          "  -w  print the records from a running daemon's ring\n"
+          "  a device of - reads stdin\n", stderr);
+    exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    uint32_t baud = 115200, capacity = 65536;
+    bool to_binary = false, watching = false;
+    const char *cal_file = 0, *name = "/capmeter";
+    for (int opt; (opt = getopt(argc, argv, "b:Bc:n:s:w")) != -1; ) {
+        switch (opt) {
+        case 'b': baud = strtoul(optarg, 0, 10); break;
+        case 'B': to_binary = true; break;
+        case 'c': cal_file = optarg; break;
+        case 'n': capacity = strtoul(optarg, 0, 10); break;
+        case 's': name = optarg; break;
+        case 'w': watching = true; break;
+        default: usage();
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; // no SA_RESTART, so epoll_wait() returns
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    if (watching)
+        return watch(name);
+
+    const int n_boards = argc - optind;
+    if (n_boards < 1 || n_boards > (int)capmeterd::max_boards || capacity < 1 ||
+        capacity > 1u << 30)
+        usage();
+    uint32_t pow2 = 1;
+    while (pow2 < capacity)
+        pow2 <<= 1;
+
+    std::vector<board*> boards;
+    for (int i = 0; i < n_boards; i++)
+        boards.push_back(new board(i, argv[optind + i]));
+    if (cal_file && !load_cal(cal_file, boards)) {
+        perror(cal_file);
+        return 1;
+    }
+    publisher d;
+    if (!d.map(name, pow2)) {
+        perror(name);
+        return 1;
+    }
+    out = &d;
+
+    const int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    size_t up = 0;
+    for (size_t i = 0; i < boards.size(); i++)
+        if (open_board(*boards[i], ep, baud, to_binary))
+            up++;
+        else
+            perror(boards[i]->path.c_str());
+    const bool all_stdin = boards.size() == 1 && boards[0]->path == "-";
+
+    epoll_event ev[64];
+    uint64_t last = now_ns(CLOCK_MONOTONIC);
+    while (!stopping) {
+        const int k = epoll_wait(ep, ev, sizeof(ev)/sizeof(*ev), 1000);
+        if (k < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < k; i++) {
+            board &b = *boards[ev[i].data.u32];
+            const bool ok = b.r.read() && !(ev[i].events & EPOLLERR) &&
+                            ((ev[i].events & EPOLLIN) || !(ev[i].events & EPOLLHUP));
+            d.publish(b);
+            if (!ok) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, b.r.fd(), 0);
+                b.r.close();
+                up--;
+            }
+        }
+        if (all_stdin && !up)
+            break; // a pipe, done with
+        // Counters, and reopening anything that's gone, once a second
+        const uint64_t t = now_ns(CLOCK_MONOTONIC);
+        if (t - last >= 1000000000) {
+            for (size_t i = 0; i < boards.size(); i++) {
+                board &b = *boards[i];
+                if (b.r.fd() < 0 && b.path != "-" && open_board(b, ep, baud, to_binary))
+                    up++;
+            }
+            d.tick(boards, (t - last)*1e-9);
+            last = t;
+        }
+    }
+    d.flush_all(boards);
+    d.tick(boards, (now_ns(CLOCK_MONOTONIC) - last)*1e-9);
+
+    for (size_t i = 0; i < boards.size(); i++) {
+        const board &b = *boards[i];
+        const capmeter::counters &c = b.r.parse().count();
+        fprintf(stderr, "%s: %llu bytes, %u frames, %llu readings, %u CRC errors, "
+                "%u bytes skipped, %u lost, %u reopens\n", b.path.c_str(),
+                (unsigned long long)c.bytes, c.frames, (unsigned long long)b.readings,
+                c.crc_errors, c.skipped, c.lost, b.reopens);
+        delete boards[i];
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+Layout of capmeterd's shared-memory ring, for the programs that read it. The
+daemon is the only writer; any number of readers can map the segment read-only
+(shm_open(name, O_RDONLY), then mmap of ring_size()) and follow head.
+
+A reader keeps its own tail. Record i goes in records[i & (capacity-1)], and
+each slot has a sequence number, a seqlock: the writer sets it to 2*i + 1
+before it starts on the record and to 2*i + 2 once it's done, and only then
+moves head past it. To read record i, load seq with acquire; if it isn't
+2*i + 2, the slot is being written or already holds a later record, and the
+writer lapped the reader. Otherwise copy the record out, fence with acquire
+and load seq again: if it changed, the copy may be torn, and the writer
+lapped the reader just the same. Either way, skip ahead to head - capacity.
+The board table is rewritten once a second.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace capmeterd {
+
+static const uint32_t shm_magic = 0x52504143; // "CAPR"
+static const uint16_t shm_version = 2;
+static const unsigned max_boards = 64;
+
+enum record_kind { KIND_SAMPLE, KIND_OVERFLOW, KIND_BURST, KIND_STATS };
+
+struct record {
+    uint64_t host_ns;  // CLOCK_REALTIME when the batch it came in was read
+    double farads;     // with the board's calibration; infinity for an overflow
+    float sd;          // standard deviation in farads for bursts and statistics
+    uint32_t stamp;    // the meter's timestamp in us
+    uint16_t board;    // index into boards
+    uint16_t n;        // captures behind it, 1 for samples
+    uint8_t channel, r_index, kind, pad;
+};
+static_assert(sizeof(record) == 32, "record layout");
+
+struct slot {
+    uint64_t seq;      // 2*i + 2 once record i is in it, odd while it's written
+    record rec;
+};
+
+struct board {
+    char path[48];
+    uint8_t up;        // the port is open
+    uint8_t pad[3];
+    uint32_t reopens;
+    uint64_t bytes, frames, readings, crc_errors, skipped, lost;
+    float bytes_per_s, readings_per_s; // over the last second
+};
+
+struct ring {
+    uint32_t magic;
+    uint16_t version, n_boards;
+    uint32_t capacity; // records, a power of 2
+    uint32_t pad;
+    uint64_t head;     // records written; read with __atomic_load_n(..., __ATOMIC_ACQUIRE)
+    board boards[max_boards];
+    slot records[1];   // capacity of them
+};
+
+static inline size_t ring_size(uint32_t capacity) {
+    return offsetof(ring, records) + (size_t)capacity*sizeof(slot);
+}
+
+} // namespace capmeterd
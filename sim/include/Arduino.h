@@ -0,0 +1,97 @@
+/*
+Host stand-in for the parts of the Arduino core and avr-libc that capmeter.ino
+uses, so that sim.cpp can compile the sketch unchanged. Only the ATmega2560
+registers and bits the sketch touches are here.
+
+Peripheral registers are sfr<> objects that call into the simulation on every
+read and write, so it can keep the timers, comparator, ADC and USART live. Port
+registers are plain bytes: the sketch takes their addresses, and the
+simulation only needs to look at them between ISRs.
+*/
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binary.h"
+
+#define __AVR_ATmega2560__ 1
+#define F_CPU 16000000UL
+#define ISR(vector) extern "C" void vector(void)
+#define DEC 10
+#define HEX 16
+
+// Ports: DDRx, PORTx, PINx
+#define SIM_PORTS(X) X(A) X(B) X(C) X(D) X(E) X(F) X(G) X(H) X(J) X(K) X(L)
+#define SIM_PORT_DECL(p) extern volatile uint8_t DDR##p, PORT##p, PIN##p;
+SIM_PORTS(SIM_PORT_DECL)
+extern volatile uint8_t MCUCR, MCUSR, SMCR, DIDR0, DIDR1, DIDR2,
+                        PCICR, PCIFR, PCMSK1;
+
+// Peripheral registers, by width
+#define SIM_SFR8(X) \
+    X(PRR0) X(PRR1) X(ACSR) X(ADCSRA) X(ADCSRB) X(ADMUX) \
+    X(TIMSK1) X(TIFR1) X(TCCR1A) X(TCCR1B) \
+    X(TIMSK3) X(TIFR3) X(TCCR3A) X(TCCR3B) \
+    X(TIMSK4) X(TIFR4) X(TCCR4A) X(TCCR4B) \
+    X(TIMSK5) X(TIFR5) X(TCCR5A) X(TCCR5B) X(SREG) X(WDTCSR) \
+    X(UCSR0A) X(UCSR0B) X(UCSR0C) X(UDR0)
+#define SIM_SFR16(X) \
+    X(ADC) X(TCNT1) X(ICR1) X(TCNT3) X(OCR3A) X(OCR3B) X(TCNT4) \
+    X(TCNT5) X(ICR5) X(UBRR0)
+
+#define SIM_SFR_ID(name) SFR_##name,
+enum sfr_id { SIM_SFR8(SIM_SFR_ID) SIM_SFR16(SIM_SFR_ID) };
+
+// Return the value read, or the value to store after a write
+unsigned sim_sfr_read(sfr_id id, unsigned stored);
+unsigned sim_sfr_write(sfr_id id, unsigned stored, unsigned written);
+
+template<typename T, sfr_id ID> struct sfr {
+    T v;
+    operator T() const { return sim_sfr_read(ID, v); }
+    sfr &operator=(T x) { v = sim_sfr_write(ID, v, x); return *this; }
+    sfr &operator|=(unsigned x) { return *this = T(*this) | x; }
+    sfr &operator&=(unsigned x) { return *this = T(*this) & x; }
+};
+#define SIM_SFR8_DECL(name) extern sfr<uint8_t, SFR_##name> name;
+#define SIM_SFR16_DECL(name) extern sfr<uint16_t, SFR_##name> name;
+SIM_SFR8(SIM_SFR8_DECL)
+SIM_SFR16(SIM_SFR16_DECL)
+
+enum { // bit numbers
+    PRTIM1 = 3, PRUSART0 = 1, PRADC = 0,  // PRR0
+    PRTIM5 = 5, PRTIM4 = 4, PRTIM3 = 3,   // PRR1
+    SM0 = 1, SE = 0, PUD = 4, WDRF = 3,   // SMCR, MCUCR, MCUSR
+    WDIF = 7, WDIE = 6, WDP3 = 5, WDCE = 4, WDE = 3, WDP0 = 0,
+    PCIE1 = 1, PCIF1 = 1, PCINT8 = 0,     // PCICR, PCIFR, PCMSK1
+    AIN1D = 1, AIN0D = 0,                 // DIDR1
+    ACD = 7, ACBG = 6, ACO = 5, ACI = 4, ACIE = 3, ACIC = 2, ACIS0 = 0,
+    ADEN = 7, ADSC = 6, ADATE = 5, ADIF = 4, ADIE = 3, ADPS0 = 0,
+    ACME = 6, MUX5 = 3, ADTS0 = 0,        // ADCSRB
+    REFS1 = 7, REFS0 = 6, ADLAR = 5, MUX0 = 0,
+    ICIE1 = 5, OCIE1C = 3, OCIE1B = 2, OCIE1A = 1, TOIE1 = 0,
+    ICF1 = 5, OCF1C = 3, OCF1B = 2, OCF1A = 1, TOV1 = 0,
+    COM1A0 = 6, COM1B0 = 4, COM1C0 = 2, WGM10 = 0,
+    ICNC1 = 7, ICES1 = 6, WGM12 = 3, CS10 = 0,
+    OCIE3B = 2, OCIE3A = 1, TOIE3 = 0, OCF3B = 2, OCF3A = 1, TOV3 = 0,
+    COM3A0 = 6, COM3B0 = 4, COM3C0 = 2, WGM30 = 0,
+    ICNC3 = 7, ICES3 = 6, WGM32 = 3, CS30 = 0,
+    TOIE4 = 0, TOV4 = 0, COM4A0 = 6, COM4B0 = 4, COM4C0 = 2, WGM40 = 0,
+    WGM42 = 3, CS40 = 0,
+    ICIE5 = 5, TOIE5 = 0, ICF5 = 5, TOV5 = 0, WGM50 = 0,
+    ICNC5 = 7, ICES5 = 6, WGM52 = 3, CS50 = 0,
+    RXC0 = 7, TXC0 = 6, UDRE0 = 5, U2X0 = 1,
+    RXCIE0 = 7, TXCIE0 = 6, UDRIE0 = 5, RXEN0 = 4, TXEN0 = 3, UCSZ02 = 2,
+    UMSEL00 = 6, UPM00 = 4, USBS0 = 3, UCSZ00 = 1
+};
+
+void cli();
+void sei();
+
+// avr-libc's <stdlib.h> extras
+char *ultoa(unsigned long x, char *buf, int radix);
+char *dtostrf(double x, signed char width, unsigned char prec, char *buf);
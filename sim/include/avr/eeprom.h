@@ -0,0 +1,7 @@
+// EEPROM as a host array, which the simulation can load and save
+#pragma once
+
+#include <stddef.h>
+
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
@@ -0,0 +1,7 @@
+// Flash is ordinary memory on the host
+#pragma once
+
+#include <string.h>
+
+#define PROGMEM
+#define memcpy_P memcpy
@@ -0,0 +1,5 @@
+// Sleeping hands control to the simulation until the next interrupt
+#pragma once
+
+void sim_sleep();
+#define sleep_cpu() sim_sleep()
@@ -0,0 +1,5 @@
+// The watchdog reset instruction
+#pragma once
+
+void sim_wdr();
+#define wdt_reset() sim_wdr()
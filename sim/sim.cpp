@@ -0,0 +1,1064 @@
+/*
+Host simulation of capmeter.ino. The sketch is compiled unchanged against the
+stand-ins in include/, and the parts of the ATmega2560 it relies on - timers 1,
+3, 4 and 5, the comparator, the ADC, USART0, the watchdog and sleep modes - are
+modelled here, along with an RC circuit on each DUT socket. That lets the measurement loop be exercised,
+timed and benchmarked without a board.
+
+From the repository root:
+    g++ -std=gnu++11 -O2 -Wall -Isim/include sim/sim.cpp -o capmeter-sim
+    ./capmeter-sim              # sweep 1pF to 10mF and report
+    ./capmeter-sim -c 4.7e-6    # one part, with the sketch's output
+    ./capmeter-sim -q -b sim/regress.txt # autoranging against the baseline
+Sketch options can be given with -D, e.g. -DOUTPUT_BINARY=1 -DBURST_MS=500.
+
+Simulated time is kept in CPU cycles. ISRs run in zero simulated time, and the
+power reduction and sleep mode registers aren't modelled.
+*/
+
+#include <Arduino.h>
+#include "../capmeter.ino"
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#define SIM_PORT_DEF(p) volatile uint8_t DDR##p, PORT##p, PIN##p;
+SIM_PORTS(SIM_PORT_DEF)
+volatile uint8_t MCUCR, MCUSR, SMCR, DIDR0, DIDR1, DIDR2, PCICR, PCIFR, PCMSK1;
+#define SIM_SFR8_DEF(name) sfr<uint8_t, SFR_##name> name;
+#define SIM_SFR16_DEF(name) sfr<uint16_t, SFR_##name> name;
+SIM_SFR8(SIM_SFR8_DEF)
+SIM_SFR16(SIM_SFR16_DEF)
+
+namespace sim {
+
+static const double bandgap = 1.1,
+                    r_pullup = 35e3; // weak pullup, ch31.2
+static const uint64_t never = UINT64_MAX;
+
+struct stop { }; // thrown through the sketch at the end of a run
+
+// Run settings
+static double t_run = 5;       // seconds
+static double c_part = 1e-9,   // F on every socket
+              c_stray = 0;     // F added to it, from wiring and pins
+static double esr = 0;         // ohms in series with the part
+static double noise = 0;       // comparator threshold noise, V rms
+static double chatter = 0;     // V above the threshold the comparator glitches from
+static double vcc = 5;         // supply, which the sketch assumes is 5V
+static bool echo = false;      // copy the sketch's output to stdout
+static bool keep_tx = false;   // and/or keep it in tx_log
+static std::string tx_log;
+static std::string input;      // sent to the sketch, a byte at a time
+static double input_at = 1;    // s, when the input starts
+static std::string eeprom_file; // EEPROM image loaded at start, saved at end
+static std::vector<std::pair<double, double> > swaps; // (s, F) part changes
+static bool quiet_regress = false; // only show the regressed cases
+
+static uint64_t now, end;      // CPU cycles since reset
+static bool irq_enabled;
+static std::mt19937 rng(1);
+
+static double seconds(uint64_t cycles) { return cycles / (double)F_CPU; }
+
+// Timers 1, 3, 4 and 5, normal mode only
+static const unsigned prescale_of[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+struct timer {
+    unsigned ps;   // 0 while stopped
+    int64_t base;  // cycle at which the count was 0
+    uint16_t held; // count while stopped
+
+    unsigned paused; // ps while the clock is stopped by sleep
+
+    uint64_t total() const { return (now - base)/ps; }
+    uint16_t count() const { return ps ? total() : held; }
+    void set(uint16_t c) { held = c; base = (int64_t)now - (int64_t)c*ps; }
+    void clock(unsigned cs) {
+        held = count();
+        ps = prescale_of[cs & 7];
+        set(held);
+    }
+    void pause() { held = count(); paused = ps; ps = 0; }
+    void resume() { ps = paused; set(held); }
+    uint64_t next_wrap() const {
+        return ps ? base + (((total() >> 16) + 1) << 16)*ps : never;
+    }
+    uint64_t next_match(uint16_t ocr) const {
+        if (!ps) return never;
+        const uint64_t k = total();
+        return base + (k + (uint16_t)(ocr - k - 1) + 1)*ps;
+    }
+};
+static timer t1, t3, t4, t5;
+
+// A DUT socket: the part, with esr in series, is tied to the supply, and the
+// node is at vcc - vc less the drop across the esr
+struct dut {
+    double C, vc;
+    double g, vc_inf; // Thevenin conductance and final vc for the current drive
+
+    double k() const { return esr*g/(1 + esr*g); } // share of vc - vc_inf across the esr
+    double node() const { return vcc - vc - (vc_inf - vc)*k(); }
+    double tau() const { return C*(1 + esr*g)/g; }
+    double vc_at(double v) const { // vc at which the node is at v
+        return (vcc - v - vc_inf*k())/(1 - k());
+    }
+    void advance(double dt) {
+        if (g > 0)
+            vc = vc_inf + (vc - vc_inf)*exp(-dt/tau());
+    }
+    void drive(const channel &ch) {
+        double i = 0;
+        g = 0;
+        for (uint8_t p = 0; p < n_drive; p++) {
+            const uint8_t bit = 1 << (p + ch.shift);
+            double v = vcc, r = drive_R[p];
+            if (*ch.ddr & bit)
+                v = *ch.port & bit ? vcc : 0;
+            else if (*ch.port & bit)
+                r += r_pullup;
+            else
+                continue;
+            g += 1/r;
+            i += v/r;
+        }
+        vc_inf = g > 0 ? vcc - i/g : vc;
+    }
+};
+static dut duts[n_sockets];
+static double threshold; // node voltage at which the comparator trips
+static double threshold5; // and the ICP5 socket's external one, off 0.22 of the supply
+
+// Socket on the comparator - input, or -1
+static int comparator_dut() {
+    if ((ACSR.v & (1 << ACD)) || !(ACSR.v & (1 << ACBG)))
+        return -1;
+    if ((ADCSRB.v & (1 << ACME)) && !(ADCSRA.v & (1 << ADEN))) {
+        const uint8_t mux = (ADCSRB.v >> MUX5 & 1)*8 + (ADMUX.v & B111);
+        for (uint8_t c = 0; c < CHANNELS; c++)
+            if (channels[c].mux == mux)
+                return c;
+        return -1;
+    }
+    return channels[0].mux == 0xFF ? 0 : -1;
+}
+
+// Voltage seen on ADC pin k: a sense pin, or a drive pin read through its R
+static double adc_pin(uint8_t k) {
+    volatile uint8_t *ddr = k < 8 ? &DDRF : &DDRK, *port = k < 8 ? &PORTF : &PORTK;
+    const uint8_t bit = 1 << (k & 7);
+    if (*ddr & bit)
+        return *port & bit ? vcc : 0;
+    for (uint8_t c = 0; c < n_sockets; c++) {
+        const channel &ch = socket_of(c);
+        if (ch.mux == k || (ch.ddr == ddr && (B111 << ch.shift & bit)))
+            return duts[c].node();
+    }
+    return 0;
+}
+
+// ADC referenced to AVCC: single conversions, free running, or auto-triggered
+// by the timer 1 capture event. The input is held partway through (fig 26-7)
+// and the result lands at the end.
+static uint64_t adc_done = never, adc_hold = never;
+static bool adc_first;
+static uint16_t adc_held;
+
+static uint16_t adc_convert() {
+    const uint8_t k = (ADCSRB.v >> MUX5 & 1)*8 + (ADMUX.v & B111);
+    const double code = adc_pin(k)/vcc*1024;
+    return code < 0 ? 0 : code > 1023 ? 1023 : (uint16_t)code;
+}
+
+static void adc_start(bool triggered) {
+    const unsigned ps = 1 << std::max(1u, ADCSRA.v & 7u);
+    adc_hold = now + (adc_first ? 13.5*ps : triggered ? 2*ps + 3 : 1.5*ps);
+    adc_done = now + (adc_first ? 25 : 13)*ps;
+    adc_first = false;
+}
+
+// USART0, 8N1: a byte in the shift register and at most one waiting in UDR
+static uint64_t byte_cycles = 10*16;
+static uint64_t tx_free;   // cycle at which the shift register empties
+static uint64_t txc_clear; // cycle at which TXC0 was last cleared
+static uint64_t tx_bytes, tx_cycles; // sent, and the time taken at the rate then
+static size_t rx_sent;     // bytes of input arrived so far
+static uint8_t rx_data;
+
+static bool udr_empty() { return tx_free <= now + byte_cycles; }
+
+static uint64_t next_udre() {
+    return udr_empty() ? never : tx_free - byte_cycles;
+}
+static uint64_t next_rx() {
+    return rx_sent < input.size() ?
+        (uint64_t)(input_at*F_CPU) + (rx_sent + 1)*byte_cycles : never;
+}
+static bool txc() {
+    return tx_bytes && now >= tx_free && tx_free > txc_clear;
+}
+static void set_baud() {
+    byte_cycles = 10*(UCSR0A.v & (1 << U2X0) ? 8 : 16)*(UBRR0.v + 1);
+}
+
+// Watchdog, interrupt mode only. Its 128kHz oscillator is taken as 5% slow, a
+// typical part, so that the sketch's calibration of it matters.
+static const double wdt_hz = 128e3*0.95;
+static uint64_t wdt_due = never, wdt_reset_at;
+
+static uint64_t wdt_period() {
+    const uint8_t v = WDTCSR.v, wdp = (v >> WDP3 & 1)*8 + (v >> WDP0 & B111);
+    return (2048ULL << wdp)/wdt_hz*F_CPU;
+}
+
+// EEPROM, erased to 0xFF unless loaded from eeprom_file
+static uint8_t eeprom[4096];
+
+// Captures seen, for the reports
+struct logged {
+    uint64_t at;
+    uint8_t channel, r_index;
+    uint32_t timer;
+    bool queued; // false if the ring was full, and timer is unknown
+};
+static std::vector<logged> captured;
+
+static size_t swapped; // swaps done so far
+
+static uint64_t next_swap() {
+    return swapped < swaps.size() ? swaps[swapped].first*F_CPU : never;
+}
+
+// Earliest thing due to happen in hardware, which may be after the run ends
+static uint64_t next_event() {
+    uint64_t t = end;
+    const int d = comparator_dut();
+    if (t1.ps && d >= 0 && (ACSR.v & (1 << ACIC))) {
+        const dut &p = duts[d];
+        const double vt = p.vc_at(threshold);
+        if (p.vc < vt && p.vc_inf > vt) {
+            const double dt = log(((p.vc_inf - p.vc)/(p.vc_inf - vt)))*p.tau();
+            t = std::min(t, now + std::max<uint64_t>(1, ceil(dt*F_CPU)));
+        }
+    }
+    #if ICP5_SOCKET
+    if (t5.ps && !(TIFR5.v & (1 << ICF5))) {
+        const dut &p = duts[icp5_chan];
+        const double vt = p.vc_at(threshold5);
+        if (p.vc < vt && p.vc_inf > vt) {
+            const double dt = log(((p.vc_inf - p.vc)/(p.vc_inf - vt)))*p.tau();
+            t = std::min(t, now + std::max<uint64_t>(1, ceil(dt*F_CPU)));
+        }
+    }
+    #endif
+    t = std::min(t, t1.next_wrap());
+    t = std::min(t, t3.next_wrap());
+    t = std::min(t, t3.next_match(OCR3A.v));
+    t = std::min(t, t3.next_match(OCR3B.v));
+    t = std::min(t, t4.next_wrap());
+    t = std::min(t, t5.next_wrap());
+    t = std::min(t, next_rx());
+    t = std::min(t, next_udre());
+    t = std::min(t, next_swap());
+    t = std::min(t, adc_hold);
+    t = std::min(t, wdt_due);
+    return std::min(t, adc_done);
+}
+
+// Move everything forward to t, and set the flags of whatever happens then
+static void advance(uint64_t t) {
+    if (t >= end) {
+        now = end;
+        throw stop();
+    }
+    const uint64_t prev = now;
+    for (uint8_t c = 0; c < n_sockets; c++)
+        duts[c].advance(seconds(t - prev));
+
+    const uint64_t wrap1 = t1.next_wrap(), wrap3 = t3.next_wrap(),
+                   match3 = t3.next_match(OCR3A.v), match3b = t3.next_match(OCR3B.v),
+                   wrap4 = t4.next_wrap(), wrap5 = t5.next_wrap();
+    now = t;
+
+    const int d = comparator_dut();
+    if (t1.ps && d >= 0 && (ACSR.v & (1 << ACIC)) && duts[d].node() <= threshold
+        && !(TIFR1.v & (1 << ICF1))) {
+        // The noise canceller lags the capture by 4 cycles, ch17.6.2
+        const uint64_t at = now + (TCCR1B.v & (1 << ICNC1) ? 4 : 0);
+        ICR1.v = (at - t1.base)/t1.ps;
+        TIFR1.v |= 1 << ICF1;
+        threshold = -1; // no second edge until the next start
+        if ((ADCSRA.v & (1 << ADEN)) && (ADCSRA.v & (1 << ADATE)) &&
+            (ADCSRB.v >> ADTS0 & B111) == B111 && adc_done == never)
+            adc_start(true);
+    }
+    #if ICP5_SOCKET
+    if (t5.ps && duts[icp5_chan].node() <= threshold5 && !(TIFR5.v & (1 << ICF5))) {
+        const uint64_t at = now + (TCCR5B.v & (1 << ICNC5) ? 4 : 0);
+        ICR5.v = (at - t5.base)/t5.ps;
+        TIFR5.v |= 1 << ICF5;
+        threshold5 = -1;
+    }
+    #endif
+    if (wrap1 == t) TIFR1.v |= 1 << TOV1;
+    if (wrap3 == t) TIFR3.v |= 1 << TOV3;
+    if (match3 == t) TIFR3.v |= 1 << OCF3A;
+    if (match3b == t) TIFR3.v |= 1 << OCF3B;
+    if (wrap4 == t) TIFR4.v |= 1 << TOV4;
+    if (wrap5 == t) TIFR5.v |= 1 << TOV5;
+    if (next_swap() == t) { // new part goes in uncharged
+        const double C = swaps[swapped++].second;
+        for (uint8_t c = 0; c < n_sockets; c++) {
+            duts[c].C = std::max(C + c_stray, 1e-15);
+            duts[c].vc = 0;
+        }
+    }
+    if (next_rx() == t) {
+        rx_data = input[rx_sent++];
+        UCSR0A.v |= 1 << RXC0;
+    }
+    if (wdt_due == t) {
+        WDTCSR.v |= 1 << WDIF;
+        wdt_due += wdt_period();
+    }
+    if (adc_hold == t) {
+        adc_hold = never;
+        adc_held = adc_convert();
+    }
+    if (adc_done == t) {
+        adc_done = never;
+        ADC.v = adc_held;
+        ADCSRA.v = (ADCSRA.v & ~(1 << ADSC)) | (1 << ADIF);
+        if ((ADCSRA.v & (1 << ADATE)) && !(ADCSRB.v >> ADTS0 & B111)) {
+            ADCSRA.v |= 1 << ADSC; // free running: straight into the next
+            adc_start(false);
+        }
+    }
+}
+
+// Pick up pin changes made by the sketch
+static void resync() {
+    for (uint8_t c = 0; c < n_sockets; c++)
+        duts[c].drive(socket_of(c));
+}
+
+// Run pending ISRs in vector priority order, as the AVR would
+static void service() {
+    while (irq_enabled) {
+        void (*isr)() = 0;
+        if ((PCIFR & (1 << PCIF1)) && (PCICR & (1 << PCIE1))) {
+            PCIFR &= ~(1 << PCIF1); isr = PCINT1_vect;
+        } else if ((WDTCSR.v & (1 << WDIF)) && (WDTCSR.v & (1 << WDIE))) {
+            WDTCSR.v &= ~(1 << WDIF); isr = WDT_vect;
+        } else if ((TIFR1.v & TIMSK1.v & (1 << ICIE1))) {
+            TIFR1.v &= ~(1 << ICF1); isr = TIMER1_CAPT_vect;
+        } else if (TIFR1.v & TIMSK1.v & (1 << TOIE1)) {
+            TIFR1.v &= ~(1 << TOV1); isr = TIMER1_OVF_vect;
+        } else if ((UCSR0A.v & (1 << RXC0)) && (UCSR0B.v & (1 << RXCIE0))) {
+            isr = USART0_RX_vect; // RXC0 is cleared by reading UDR0
+        } else if (udr_empty() && (UCSR0B.v & (1 << UDRIE0))) {
+            isr = USART0_UDRE_vect;
+        } else if ((ADCSRA.v & (1 << ADIF)) && (ADCSRA.v & (1 << ADIE))) {
+            ADCSRA.v &= ~(1 << ADIF); isr = ADC_vect;
+        } else if (TIFR3.v & TIMSK3.v & (1 << OCIE3A)) {
+            TIFR3.v &= ~(1 << OCF3A); isr = TIMER3_COMPA_vect;
+        }
+        #if ICP5_SOCKET
+        else if (TIFR3.v & TIMSK3.v & (1 << OCIE3B)) {
+            TIFR3.v &= ~(1 << OCF3B); isr = TIMER3_COMPB_vect;
+        }
+        #endif
+        else if (TIFR3.v & TIMSK3.v & (1 << TOIE3)) {
+            TIFR3.v &= ~(1 << TOV3); isr = TIMER3_OVF_vect;
+        }
+        else if (TIFR4.v & TIMSK4.v & (1 << TOIE4)) {
+            TIFR4.v &= ~(1 << TOV4); isr = TIMER4_OVF_vect;
+        }
+        #if ICP5_SOCKET
+        else if (TIFR5.v & TIMSK5.v & (1 << ICIE5)) {
+            TIFR5.v &= ~(1 << ICF5); isr = TIMER5_CAPT_vect;
+        } else if (TIFR5.v & TIMSK5.v & (1 << TOIE5)) {
+            TIFR5.v &= ~(1 << TOV5); isr = TIMER5_OVF_vect;
+        }
+        #endif
+        else
+            break;
+
+        uint8_t a = active;
+        #if ICP5_SOCKET
+        if (isr == TIMER5_CAPT_vect || isr == TIMER5_OVF_vect)
+            a = icp5_chan;
+        #endif
+        const uint8_t r = chans[a].r_index, head = ring_head;
+        const uint16_t s = ::seq;
+        irq_enabled = false;
+        isr();
+        irq_enabled = true;
+        resync();
+        if (::seq != s) {
+            capture cap = ring[head];
+            #if SLOPE_ADC
+            slope_correct(cap); // as loop() will, so the reports see it
+            #endif
+            const logged l = {now, a, r, cap.timer, ring_head != head};
+            captured.push_back(l);
+        }
+    }
+}
+
+} // namespace sim
+
+using namespace sim;
+
+void cli() { irq_enabled = false; }
+void sei() { irq_enabled = true; }
+void sim_sleep() {
+    const unsigned mode = SMCR >> SM0 & B111;
+    if (!mode) { // idle: everything keeps running
+        advance(next_event());
+        service();
+        return;
+    }
+    /*
+    Standby or power-down: the I/O clock stops, so the timers and UART do too,
+    and only the watchdog or a pin change on RXD0 wakes us. A byte that arrives
+    before the UART is running again is lost. Power-down takes 16K CK to start
+    up again, standby 6.
+    */
+    t1.pause(); t3.pause(); t4.pause(); t5.pause();
+    for (bool woke = false; !woke; ) {
+        advance(next_event());
+        if (UCSR0A.v & (1 << RXC0)) {
+            UCSR0A.v &= ~(1 << RXC0);
+            if ((PCICR & (1 << PCIE1)) && (PCMSK1 & (1 << PCINT8))) {
+                PCIFR |= 1 << PCIF1;
+                woke = true;
+            }
+        }
+        woke |= (WDTCSR.v & (1 << WDIF)) && (WDTCSR.v & (1 << WDIE));
+    }
+    const uint64_t ready = now + (mode == B010 ? 16384 : 6);
+    for (uint64_t e; (e = next_event()) <= ready; ) {
+        advance(e);
+        UCSR0A.v &= ~(1 << RXC0);
+    }
+    advance(ready);
+    t1.resume(); t3.resume(); t4.resume(); t5.resume();
+    service();
+}
+
+void sim_wdr() {
+    wdt_reset_at = now;
+    if (wdt_due != never)
+        wdt_due = now + wdt_period();
+}
+
+unsigned sim_sfr_read(sfr_id id, unsigned stored) {
+    switch (id) {
+    case SFR_TCNT1: return t1.count();
+    case SFR_TCNT3: return t3.count();
+    case SFR_TCNT4: return t4.count();
+    case SFR_TCNT5: return t5.count();
+    case SFR_SREG: return (stored & 0x7F) | (irq_enabled ? 0x80 : 0);
+    case SFR_UCSR0A:
+        return (stored & ~(1 << UDRE0) & ~(1 << TXC0)) |
+               (udr_empty() ? 1 << UDRE0 : 0) | (txc() ? 1 << TXC0 : 0);
+    case SFR_UDR0:
+        UCSR0A.v &= ~(1 << RXC0);
+        return rx_data;
+    default: return stored;
+    }
+}
+
+unsigned sim_sfr_write(sfr_id id, unsigned stored, unsigned v) {
+    switch (id) {
+    case SFR_TCCR1B:
+        if (!t1.ps && (v & B111)) // a new charge; draw its trip point
+            threshold = bandgap +
+                (noise > 0 ? std::normal_distribution<double>(0, noise)(rng) : 0) +
+                // the first glitch trips it, unless the noise canceller's on;
+                // they're all shorter than its 4 cycles
+                (v & (1 << ICNC1) ? 0 : chatter);
+        t1.clock(v & B111);
+        return v;
+    case SFR_TCCR3B: t3.clock(v & B111); return v;
+    case SFR_TCCR4B: t4.clock(v & B111); return v;
+    case SFR_TCCR5B:
+        if (!t5.ps && (v & B111)) // as timer 1's, off the external reference
+            threshold5 = 0.22*vcc +
+                (noise > 0 ? std::normal_distribution<double>(0, noise)(rng) : 0) +
+                (v & (1 << ICNC5) ? 0 : chatter);
+        t5.clock(v & B111);
+        return v;
+    case SFR_SREG: irq_enabled = v & 0x80; return v;
+    case SFR_UBRR0:
+        UBRR0.v = v;
+        set_baud();
+        return v;
+    case SFR_UCSR0A:
+        UCSR0A.v = (stored & (1 << RXC0)) | (v & (1 << U2X0));
+        if (v & (1 << TXC0))
+            txc_clear = now;
+        set_baud();
+        return UCSR0A.v;
+    case SFR_UDR0:
+        if (!(UCSR0B.v & (1 << TXEN0)) || !udr_empty())
+            return stored; // not enabled, or overwriting a byte; the sketch shouldn't
+        if (echo) putchar(v);
+        if (keep_tx) tx_log += (char)v;
+        tx_bytes++;
+        tx_cycles += byte_cycles;
+        tx_free = std::max(tx_free, now) + byte_cycles;
+        return v;
+    case SFR_TCNT1: t1.set(v); return v;
+    case SFR_TCNT3: t3.set(v); return v;
+    case SFR_TCNT4: t4.set(v); return v;
+    case SFR_TCNT5: t5.set(v); return v;
+    case SFR_TIFR1:
+    case SFR_TIFR3:
+    case SFR_TIFR4:
+    case SFR_TIFR5:
+        return stored & ~v; // flags are cleared by writing 1
+    case SFR_WDTCSR: {
+        const uint8_t flag = 1 << WDIF;
+        WDTCSR.v = v & ~flag & ~(1 << WDCE); // for wdt_period()
+        wdt_due = v & ((1 << WDIE) | (1 << WDE)) ? wdt_reset_at + wdt_period() : never;
+        return WDTCSR.v | (stored & flag & ~v);
+    }
+    case SFR_ADCSRA: {
+        const uint8_t flag = 1 << ADIF, en = 1 << ADEN, start = 1 << ADSC;
+        if (!(v & en))
+            adc_done = adc_hold = never;
+        else {
+            if (!(stored & en))
+                adc_first = true;
+            if ((v & start) && adc_done == never) {
+                ADCSRA.v = v; // for the prescaler
+                adc_start(false);
+            }
+        }
+        return (v & ~flag & ~start) | (stored & flag & ~v) |
+               (adc_done != never ? start : 0);
+    }
+    default:
+        return v;
+    }
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+    const size_t a = (uintptr_t)src;
+    if (a + n > sizeof(eeprom))
+        abort();
+    memcpy(dst, eeprom + a, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+    const size_t a = (uintptr_t)dst;
+    if (a + n > sizeof(eeprom))
+        abort();
+    memcpy(eeprom + a, src, n);
+}
+
+char *ultoa(unsigned long x, char *buf, int radix) {
+    char *p = buf;
+    do {
+        const unsigned d = x % radix;
+        *p++ = d < 10 ? '0' + d : 'a' + d - 10;
+        x /= radix;
+    } while (x);
+    *p = 0;
+    std::reverse(buf, p);
+    return buf;
+}
+
+char *dtostrf(double x, signed char width, unsigned char prec, char *buf) {
+    sprintf(buf, "%*.*f", width, prec, x);
+    return buf;
+}
+
+namespace sim {
+
+// Summary of one run, passed back from its process
+struct result {
+    double C;                // the part at the end
+    uint32_t captures, dropped, tx_dropped, settle_n;
+    double rate, settle_s;   // captures/s; time from the first capture, or the
+                             // first after the last swap, to settling
+    uint32_t flaps;          // range changes that reverse the one before, until settled
+    bool settled;
+    uint8_t r_final;
+    double C_mean;           // mean reading once settled
+    double bytes_per, uart;  // UART bytes per capture, and fraction of its time
+};
+
+// Fresh process per run, so the sketch's statics start from reset
+template<typename F> static bool in_child(F f, void *out, size_t len) {
+    int fds[2];
+    if (pipe(fds))
+        return false;
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        f(out);
+        fflush(stdout);
+        if (write(fds[1], out, len) != (ssize_t)len)
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    const bool ok = pid > 0 && read(fds[0], out, len) == (ssize_t)len;
+    close(fds[0]);
+    int status;
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+    return ok;
+}
+
+static void simulate(void *out) {
+    result &res = *(result*)out;
+    for (uint8_t c = 0; c < n_sockets; c++)
+        duts[c].C = std::max(c_part + c_stray, 1e-15);
+    end = t_run*F_CPU;
+
+    setup();
+    resync();
+    try {
+        loop();
+    }
+    catch (const stop &) { }
+    if (!eeprom_file.empty()) {
+        FILE *f = fopen(eeprom_file.c_str(), "wb");
+        if (f) {
+            fwrite(eeprom, 1, sizeof(eeprom), f);
+            fclose(f);
+        }
+    }
+
+    // Settled once every later capture on channel 0 is valid and on one range,
+    // counting from the last part swap if there was one
+    res.C = swaps.empty() ? c_part : swaps.back().second;
+    const std::vector<logged> &log = captured;
+    res.captures = log.size();
+    res.dropped = 0;
+    res.tx_dropped = ::tx_drops;
+    std::vector<const logged*> ch0;
+    for (size_t i = 0; i < log.size(); i++) {
+        res.dropped += !log[i].queued;
+        if (log[i].channel == 0)
+            ch0.push_back(&log[i]);
+    }
+    res.rate = log.size() > 1 ?
+        (log.size() - 1)/seconds(log.back().at - log.front().at) : 0;
+    res.bytes_per = log.size() ? tx_bytes/(double)log.size() : 0;
+    res.uart = (double)tx_cycles/end;
+    res.settled = false;
+    res.flaps = 0;
+    res.C_mean = 0;
+    size_t from = 0;
+    if (!swaps.empty())
+        while (from < ch0.size() && ch0[from]->at < swaps.back().first*F_CPU)
+            from++;
+    if (from == ch0.size())
+        return;
+
+    const logged &last = *ch0.back();
+    size_t s = ch0.size();
+    while (s > from && ch0[s-1]->r_index == last.r_index &&
+           ch0[s-1]->timer != timer_overflow)
+        s--;
+    int dir = 0;
+    for (size_t i = from + 1; i <= s && i < ch0.size(); i++) {
+        const uint8_t a = ch0[i-1]->r_index, b = ch0[i]->r_index;
+        const int d = (b > a) - (b < a);
+        if (d && dir && d != dir)
+            res.flaps++;
+        if (d)
+            dir = d;
+    }
+    res.r_final = last.r_index;
+    res.settled = s < ch0.size();
+    res.settle_n = s - from;
+    if (!res.settled)
+        return;
+    res.settle_s = seconds(ch0[s]->at - ch0[from]->at);
+
+    double sum = 0;
+    unsigned n = 0;
+    for (size_t i = s; i < ch0.size(); i++)
+        if (ch0[i]->queued) {
+            // as the sketch reports it, less the capture delay and calibration
+            sum += cal_cap(0, last.r_index, (uint64_t)ch0[i]->timer << 8)*1e-15;
+            n++;
+        }
+    res.C_mean = n ? sum/n : 0;
+}
+
+// Host time taken by each stage of the sketch's per-capture work. The sketch
+// runs natively here, so these are not AVR cycles; PROFILE builds count those
+// on the board
+struct costs { double isr, rerange, output; };
+
+template<typename F> static double ns_per(F f, unsigned n = 200000) {
+    const auto t0 = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < n; i++)
+        f(i);
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - t0).count()/n;
+}
+
+static void benchmark(void *out) {
+    costs &cost = *(costs*)out;
+    echo = false;
+    end = never;
+    setup();
+    resync();
+
+    // Capture ISR through to the next charge: discharge, queue, schedule,
+    // rerange and start_next
+    cost.isr = ns_per([](unsigned i) {
+        chans[active].r_index = 2;
+        chans[active].due = 0;
+        overflows = 0;
+        ICR1.v = 9000 + (i & 0xFFF);
+        ring_tail = ring_head;
+        TIMER1_CAPT_vect();
+    });
+    cost.rerange = ns_per([](unsigned i) {
+        chans[active].r_index = 1;
+        rerange(active, i & 0x3FFF);
+    });
+    cost.output = ns_per([](unsigned i) {
+        const capture cap = {9000 + (i & 0xFFF), i, 0, 2, (uint16_t)i, 0};
+        tx_tail = tx_head; // as if sent, so that nothing is dropped
+        output_cap(cap);
+    }, 50000);
+}
+
+static double run_time(double C, double t_base) {
+    // Leave time for about 20 full charge/discharge cycles
+    return std::max(t_base, 20*C*(drive_R[0]*taus + Rd*taud) + 0.5);
+}
+
+// One autoranging case for the regression suite: a part from reset, or a step
+// from one part to another once the first has settled
+struct regress_case {
+    char key[32];
+    double c0, c1;    // c1 is NAN for no step
+};
+struct regress_line {
+    char key[32];
+    int settle_n;     // -1 if it never settled
+    double settle_s;
+    unsigned flaps, r_final;
+    double error, wall_ms;
+};
+
+static bool run_case(const regress_case &k, double t_base, regress_line &out) {
+    c_part = k.c0;
+    swaps.clear();
+    t_run = run_time(k.c0, t_base);
+    if (!std::isnan(k.c1)) {
+        swaps.push_back(std::make_pair(t_run, k.c1));
+        t_run += run_time(k.c1, t_base);
+    }
+    echo = false;
+    result r;
+    const auto t0 = std::chrono::steady_clock::now();
+    if (!in_child(simulate, &r, sizeof(r)))
+        return false;
+    strcpy(out.key, k.key);
+    out.wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - t0).count();
+    out.settle_n = r.settled ? (int)r.settle_n : -1;
+    out.settle_s = r.settled ? r.settle_s : 0;
+    out.flaps = r.flaps;
+    out.r_final = r.settled ? r.r_final : 0;
+    out.error = r.settled && r.C > 0 ? 100*(r.C_mean/r.C - 1) : 0;
+    return true;
+}
+
+static void print_line(FILE *f, const regress_line &l) {
+    fprintf(f, "%-22s %5d %8.3f %5u %5u %9.3f %8.1f\n", l.key, l.settle_n,
+            l.settle_s, l.flaps, l.r_final, l.error, l.wall_ms);
+}
+
+static bool regressed(const regress_line &now, const regress_line &base, std::string &why) {
+    // Simulated results are exact from one run to the next, so the slack is
+    // only there to let a change trade a little of one for another; wall time
+    // depends on the host, and is only reported
+    if (base.settle_n < 0)
+        return false;
+    if (now.settle_n < 0)
+        why += " never settles";
+    else {
+        if (now.settle_n > base.settle_n + std::max(1, base.settle_n/10))
+            why += " settle_n";
+        if (now.settle_s > base.settle_s*1.1 + 0.01)
+            why += " settle_s";
+        if (now.flaps > base.flaps)
+            why += " flaps";
+        if (now.r_final != base.r_final)
+            why += " range";
+        if (fabs(now.error) > fabs(base.error) + 0.01)
+            why += " error";
+    }
+    return !why.empty();
+}
+
+// Commands for the regression suite, and text the sketch's reply must contain
+struct command_case { const char *input, *expect; };
+static const command_case command_cases[] = {
+    {"V0;C4.7u;H;", " C4.70u\r"},
+    {"V0;C1000u;H;", " C1.00m\r"},
+    {"V0;C1m;H;", " C1.00m\r"},                  // 1e12 fF per unit, past 32 bits
+    {"V0;C18446744073709551616;", "Bad command C"}, // 2^64
+    {"V0;C18446744073709552m;", "Bad command C"},   // the unit multiply overflows
+    {"V0;F99999999999999999999;", "Bad command F"},
+};
+static const command_case *checking;
+
+static void check_command(void *out) {
+    result r;
+    keep_tx = true;
+    simulate(&r);
+    *(bool*)out = tx_log.find(checking->expect) != std::string::npos;
+}
+
+static bool run_command_case(const command_case &k, bool &ok) {
+    c_part = 1e-9;
+    swaps.clear();
+    input = k.input;
+    t_run = input_at + 1;
+    echo = false;
+    checking = &k;
+    return in_child(check_command, &ok, sizeof(ok));
+}
+
+static int regress(const char *path, bool update, double t_base) {
+    // The grid of range-analysis.r, C = 10^seq(-14, -2, by=1/24), then steps
+    // between the ends of the ranges and back
+    std::vector<regress_case> cases;
+    for (int e = -14*24; e <= -2*24; e++) {
+        regress_case k;
+        k.c0 = pow(10, e/24.);
+        k.c1 = NAN;
+        snprintf(k.key, sizeof(k.key), "%.4e", k.c0);
+        cases.push_back(k);
+    }
+    static const double steps[][2] = {
+        {1e-14, 1e-2}, {1e-2, 1e-14}, {1e-12, 1e-6}, {1e-6, 1e-12},
+        {1e-9, 1e-3}, {1e-3, 1e-9}, {1e-2, 0}, {0, 1e-2},
+    };
+    for (const auto &st: steps) {
+        regress_case k;
+        k.c0 = st[0];
+        k.c1 = st[1];
+        snprintf(k.key, sizeof(k.key), "%.0e>%.0e", k.c0, k.c1);
+        cases.push_back(k);
+    }
+
+    std::vector<regress_line> base;
+    if (FILE *f = fopen(path, "r")) {
+        char buf[200];
+        while (fgets(buf, sizeof(buf), f)) {
+            regress_line l;
+            if (buf[0] != '#' &&
+                sscanf(buf, "%31s %d %lf %u %u %lf %lf", l.key, &l.settle_n,
+                       &l.settle_s, &l.flaps, &l.r_final, &l.error, &l.wall_ms) == 7)
+                base.push_back(l);
+        }
+        fclose(f);
+    } else
+        update = true;
+
+    printf("%-22s %5s %8s %5s %5s %9s %8s\n", "case", "settle", "settle_s",
+           "flaps", "range", "error%", "wall_ms");
+    std::vector<regress_line> got;
+    unsigned failed = 0, added = 0;
+    double wall = 0, wall_base = 0;
+    for (const regress_case &k: cases) {
+        regress_line l;
+        if (!run_case(k, t_base, l)) {
+            fprintf(stderr, "run failed for %s\n", k.key);
+            return 1;
+        }
+        got.push_back(l);
+        wall += l.wall_ms;
+        const regress_line *b = 0;
+        for (const regress_line &bl: base)
+            if (!strcmp(bl.key, l.key))
+                b = &bl;
+        std::string why;
+        if (b)
+            wall_base += b->wall_ms;
+        else
+            added++;
+        const bool bad = b && regressed(l, *b, why);
+        failed += bad;
+        if (bad || !quiet_regress) {
+            print_line(stdout, l);
+            if (bad) {
+                regress_line was = *b;
+                strcpy(was.key, "  was");
+                print_line(stdout, was);
+                printf("  regressed:%s\n", why.c_str());
+            }
+        }
+    }
+    // The command cases have no baseline; each either gets its reply or not
+    for (const command_case &k: command_cases) {
+        bool ok;
+        if (!run_command_case(k, ok)) {
+            fprintf(stderr, "run failed for %s\n", k.input);
+            return 1;
+        }
+        failed += !ok;
+        if (!ok || !quiet_regress)
+            printf("%-32s %s\n", k.input, ok ? "ok" : "FAILED");
+        if (!ok)
+            printf("  expected \"%s\"\n", k.expect);
+    }
+    const size_t n_commands = sizeof(command_cases)/sizeof(*command_cases);
+
+    printf("\n%zu cases and %zu commands, %u regressed, %u not in %s; wall %.0f ms",
+           got.size(), n_commands, failed, added, path, wall);
+    if (wall_base > 0)
+        printf(" against %.0f ms", wall_base);
+    putchar('\n');
+
+    if (update) {
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            perror(path);
+            return 1;
+        }
+        fputs("# capmeter-sim -b baseline; rewrite with -u\n"
+              "# case settle_n settle_s flaps r_final error% wall_ms\n", f);
+        for (const regress_line &l: got)
+            print_line(f, l);
+        fclose(f);
+        printf("wrote %s\n", path);
+        return 0;
+    }
+    return failed ? 1 : 0;
+}
+
+static void usage() {
+    fputs("usage: capmeter-sim [-c farads] [-t seconds] [-s stray] [-r ohms] [-n noise_v]\n"
+          "                    [-g volts] [-v volts] [-q] [-i input] [-w seconds] [-x seconds:farads]... [-e file]\n"
+          "       capmeter-sim -b baseline [-u] [-q] [-t seconds] [-s stray] [-r ohms] [-g volts]\n"
+          "  -c  simulate one part and show the sketch's output; default is a sweep\n"
+          "  -t  simulated time per run (sweeps extend it for big parts)\n"
+          "  -s  stray capacitance added to the part\n"
+          "  -r  series resistance (ESR) of the part\n"
+          "  -n  rms noise on the comparator threshold, in volts\n"
+          "  -g  comparator chatter from this far above the threshold, in volts\n"
+          "  -v  supply voltage; default 5\n"
+          "  -q  with -c, don't show the sketch's output\n"
+          "  -i  send this to the sketch over serial\n"
+          "  -w  time at which to start sending the input; default 1s\n"
+          "  -x  with -c, swap in another part at this time (0 to remove)\n"
+          "  -e  load EEPROM from this file if it exists, and save it after each run\n"
+          "  -b  run the autoranging regression suite against this baseline, writing\n"
+          "      it if it doesn't exist; exits 1 on a regression\n"
+          "  -u  with -b, rewrite the baseline from this run\n",
+          stderr);
+    exit(2);
+}
+
+} // namespace sim
+
+int main(int argc, char **argv) {
+    bool single = false, quiet = false, update = false;
+    const char *baseline = 0;
+    for (int opt; (opt = getopt(argc, argv, "c:t:s:r:n:g:v:qi:w:x:e:b:u")) != -1; ) {
+        switch (opt) {
+        case 'c': c_part = atof(optarg); single = true; break;
+        case 't': t_run = atof(optarg); break;
+        case 's': c_stray = atof(optarg); break;
+        case 'r': esr = atof(optarg); break;
+        case 'n': noise = atof(optarg); break;
+        case 'g': chatter = atof(optarg); break;
+        case 'v': vcc = atof(optarg); break;
+        case 'q': quiet = true; break;
+        case 'i': input = optarg; break;
+        case 'w': input_at = atof(optarg); break;
+        case 'e': eeprom_file = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 'u': update = true; break;
+        case 'x': {
+            double t, C;
+            if (sscanf(optarg, "%lf:%lf", &t, &C) != 2)
+                usage();
+            swaps.push_back(std::make_pair(t, C));
+            break;
+        }
+        default: usage();
+        }
+    }
+
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    if (!eeprom_file.empty()) {
+        FILE *f = fopen(eeprom_file.c_str(), "rb");
+        if (f) {
+            if (fread(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom))
+                fprintf(stderr, "%s: short EEPROM image\n", eeprom_file.c_str());
+            fclose(f);
+        }
+    }
+
+    if (baseline) {
+        quiet_regress = quiet;
+        return regress(baseline, update, t_run);
+    }
+
+    printf("%8s %9s %8s %8s %7s %7s %8s %5s %10s %8s %6s %6s\n",
+           "C", "captures", "dropped", "tx_drops", "rate/s", "settle", "settle_s",
+           "range", "reading", "error%", "B/cap", "uart%");
+    std::vector<double> parts;
+    if (single)
+        parts.push_back(c_part);
+    else
+        for (int e = -12; e <= -2; e++)
+            parts.push_back(pow(10, e));
+
+    const double t_base = t_run;
+    for (size_t i = 0; i < parts.size(); i++) {
+        c_part = parts[i];
+        echo = single && !quiet;
+        t_run = single ? t_base : run_time(c_part, t_base);
+        result r;
+        if (!in_child(simulate, &r, sizeof(r))) {
+            fprintf(stderr, "run failed for C=%g\n", c_part);
+            return 1;
+        }
+        if (echo)
+            putchar('\n');
+        printf("%8.0e %9u %8u %8u %7.0f ", r.C, r.captures, r.dropped, r.tx_dropped,
+               r.rate);
+        if (r.settled && r.C > 0)
+            printf("%7u %8.3f %5u %10.4g %8.3f ", r.settle_n, r.settle_s, r.r_final,
+                   r.C_mean, 100*(r.C_mean/r.C - 1));
+        else if (r.settled)
+            printf("%7u %8.3f %5u %10.4g %8s ", r.settle_n, r.settle_s, r.r_final,
+                   r.C_mean, "-");
+        else
+            printf("%7s %8s %5s %10s %8s ", "never", "-", "-", "-", "-");
+        printf("%6.1f %6.1f\n", r.bytes_per, 100*r.uart);
+    }
+
+    costs cost;
+    if (!in_child(benchmark, &cost, sizeof(cost)))
+        return 1;
+    printf("\nhost ns per call (not AVR cycles; see PROFILE): capture ISR %.0f, "
+           "rerange %.0f, output %.0f\n",
+           cost.isr, cost.rerange, cost.output);
+    return 0;
+}